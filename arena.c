@@ -0,0 +1,80 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_LEN ((size_t) 64 * 1024)
+
+typedef union {
+    void *pointer;
+    long long integer;
+    long double floating;
+} arena_align_t;
+
+#define ARENA_ALIGN (sizeof(arena_align_t))
+
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t len;
+    size_t used;
+    arena_align_t data[];
+};
+
+static arena_chunk_t *arena_chunk_new(size_t len);
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    while(arena->current == NULL || arena->current->used + size > arena->current->len) {
+        if(arena->current != NULL && arena->current->next != NULL) {
+            // Reuse a chunk left over from before the last reset.
+            arena->current = arena->current->next;
+            arena->current->used = 0;
+            continue;
+        }
+
+        arena_chunk_t *chunk = arena_chunk_new(size > ARENA_CHUNK_LEN ? size : ARENA_CHUNK_LEN);
+        if(chunk == NULL) {
+            return NULL;
+        }
+        if(arena->current == NULL) {
+            arena->first = chunk;
+        }
+        else {
+            arena->current->next = chunk;
+        }
+        arena->current = chunk;
+    }
+
+    void *mem = (unsigned char *) arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return mem;
+}
+
+char *arena_strndup(arena_t *arena, const char *text, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if(copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_reset(arena_t *arena) {
+    arena->current = arena->first;
+    if(arena->current != NULL) {
+        arena->current->used = 0;
+    }
+}
+
+static arena_chunk_t *arena_chunk_new(size_t len) {
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + len);
+    if(chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->used = 0;
+    return chunk;
+}
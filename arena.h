@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+// A bump allocator. Everything allocated from an arena is released at once by arena_reset(), which keeps the chunks
+// around for reuse, so a workload that resets regularly stops calling malloc() once it has warmed up.
+typedef struct {
+    arena_chunk_t *first;
+    arena_chunk_t *current;
+} arena_t;
+
+#define ARENA_INIT { .first = NULL, .current = NULL }
+
+// N.B. Returns NULL when out of memory
+void *arena_alloc(arena_t *arena, size_t size);
+
+// N.B. Returns NULL when out of memory
+char *arena_strndup(arena_t *arena, const char *text, size_t len);
+
+// Invalidates everything allocated from the arena so far.
+void arena_reset(arena_t *arena);
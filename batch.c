@@ -0,0 +1,129 @@
+#include "batch.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// The units a worker has yet to do: [next, end). The owner takes them from the front, thieves from the back.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} batch_queue_t;
+
+typedef struct {
+    batch_queue_t *queues;
+    size_t num_queues;
+    size_t self;
+    batch_compile_t compile;
+    void *context;
+    size_t failures;
+} batch_worker_t;
+
+static void *batch_work(void *arg);
+static bool batch_take(batch_queue_t *queue, size_t *unit);
+static bool batch_steal(batch_worker_t *worker);
+
+size_t batch_run(size_t num_units, size_t num_threads, batch_compile_t compile, void *context) {
+    if(num_threads > num_units) {
+        num_threads = num_units;
+    }
+    if(num_threads == 0) {
+        return 0;
+    }
+
+    batch_queue_t *queues = malloc(num_threads * sizeof(batch_queue_t));
+    batch_worker_t *workers = malloc(num_threads * sizeof(batch_worker_t));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    // TODO: Compiler error if out of memory
+    assert(queues != NULL && workers != NULL && threads != NULL);
+
+    for(size_t idx = 0; idx < num_threads; ++idx) {
+        int res = pthread_mutex_init(&queues[idx].lock, NULL);
+        assert(res == 0);
+        queues[idx].next = num_units * idx / num_threads;
+        queues[idx].end = num_units * (idx + 1) / num_threads;
+        workers[idx] = (batch_worker_t) {
+            .queues = queues,
+            .num_queues = num_threads,
+            .self = idx,
+            .compile = compile,
+            .context = context,
+            .failures = 0,
+        };
+    }
+
+    // The calling thread is worker 0.
+    for(size_t idx = 1; idx < num_threads; ++idx) {
+        int res = pthread_create(&threads[idx], NULL, batch_work, &workers[idx]);
+        // TODO: Compiler error if we can't start a thread
+        assert(res == 0);
+    }
+    batch_work(&workers[0]);
+
+    size_t failures = workers[0].failures;
+    for(size_t idx = 1; idx < num_threads; ++idx) {
+        int res = pthread_join(threads[idx], NULL);
+        assert(res == 0);
+        failures += workers[idx].failures;
+    }
+    for(size_t idx = 0; idx < num_threads; ++idx) {
+        pthread_mutex_destroy(&queues[idx].lock);
+    }
+
+    free(threads);
+    free(workers);
+    free(queues);
+    return failures;
+}
+
+static void *batch_work(void *arg) {
+    batch_worker_t *worker = arg;
+    batch_queue_t *own = &worker->queues[worker->self];
+
+    // N.B. Units never create more units, so once there is nothing left to take or steal, the batch is done.
+    do {
+        size_t unit;
+        while(batch_take(own, &unit)) {
+            if(worker->compile(unit, worker->context) != 0) {
+                ++worker->failures;
+            }
+        }
+    } while(batch_steal(worker));
+    return NULL;
+}
+
+static bool batch_take(batch_queue_t *queue, size_t *unit) {
+    pthread_mutex_lock(&queue->lock);
+    bool taken = queue->next < queue->end;
+    if(taken) {
+        *unit = queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+// Moves the back half of the first non-empty queue (looking at the neighbours first) into the worker's own.
+static bool batch_steal(batch_worker_t *worker) {
+    for(size_t offset = 1; offset < worker->num_queues; ++offset) {
+        batch_queue_t *victim = &worker->queues[(worker->self + offset) % worker->num_queues];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t end = victim->end;
+        // Round up, so that a single unit can be stolen too.
+        victim->end -= (left + 1) / 2;
+        size_t start = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+
+        if(start < end) {
+            batch_queue_t *own = &worker->queues[worker->self];
+            pthread_mutex_lock(&own->lock);
+            own->next = start;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+// Called for every unit of a batch, on whichever thread got to it. Returns nonzero if the unit failed.
+typedef int (*batch_compile_t)(size_t unit, void *context);
+
+// Compiles units 0 to num_units - 1 on up to num_threads threads (the calling thread being one of them), and returns how
+// many failed. Every thread starts out with an even share of the units, and once it runs out, steals half of what is
+// left of somebody else's; so a few slow units don't leave the other cores idle.
+// N.B. Each thread has its own copy of the compiler's state (see thread_local.h), so units never share anything, but a
+// thread does compile its units one after the other: compile has to reset whatever state a unit leaves behind.
+size_t batch_run(size_t num_units, size_t num_threads, batch_compile_t compile, void *context);
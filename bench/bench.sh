@@ -0,0 +1,77 @@
+#!/bin/sh
+# Runs every benchmark profile through et, with and without optimization, and prints one JSON object per line:
+#   commit, profile, opt, lines, compile_seconds, lines_per_sec, peak_rss_kb, insns, run_cycles, and one field per
+#   peephole rule (self_move, dead_write, add_zero, xor_zero, copy_chain)
+# opt is "0" (-O 0), "1" (-O 1), or "0-w2" (-O 0 -w 2: no folding or IR passes, so even the generated programs that fold
+# down to a single instruction at -O 1 keep isel, register allocation and the peephole rules busy). insns counts the
+# instructions in the assembly, each rule's field how many instructions it eliminated, and run_cycles is -1 where the
+# kernel won't count cycles for us. If et or the program it compiled fails, the line has an error field in place of the
+# measurements.
+#
+# USAGE: bench.sh <et> <bench dir> [lines] [seed]
+
+et="$1"
+dir="$2"
+lines="${3:-20000}"
+seed="${4:-1}"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+commit=$(git -C "$dir" rev-parse --short HEAD 2>/dev/null || echo unknown)
+field() {
+    # Pulls a number out of measure's JSON
+    sed -n "s/.*\"$1\": \(-\{0,1\}[0-9.]*\).*/\1/p" "$2"
+}
+eliminated() {
+    # Pulls a peephole rule's count out of et -p's report
+    sed -n "s/^$1  *\([0-9]*\) instructions eliminated.*/\1/p" "$tmp/report"
+}
+error() {
+    printf '{"commit": "%s", "profile": "%s", "opt": "%s", "lines": %s, "error": "%s"}\n' \
+        "$commit" "$profile" "$opt" "$lines" "$1"
+}
+
+for profile in deep wide compare const
+do
+    "$dir/gen" "$profile" "$seed" "$lines" >"$tmp/prog.et"
+
+    for opt in 0 1 0-w2
+    do
+        case "$opt" in
+            0-w2) flags="-O 0 -w 2" ;;
+            *) flags="-O $opt" ;;
+        esac
+        # N.B. $flags is split into words on purpose
+        "$dir/measure" sh -c "exec \"$et\" $flags -p -o \"$tmp/prog.s\" <\"$tmp/prog.et\" 2>\"$tmp/report\"" \
+            >"$tmp/compile.json"
+        status=$(field exit_status "$tmp/compile.json")
+        if [ "$status" != 0 ]
+        then
+            error "et failed (exit status ${status:-unknown})"
+            continue
+        fi
+        insns=$(grep -c '^	' "$tmp/prog.s")
+
+        if ! "$et" $flags -f exe -o "$tmp/prog" <"$tmp/prog.et"
+        then
+            error "et failed to write the executable"
+            continue
+        fi
+        "$dir/measure" -c "$tmp/prog" >"$tmp/run.json"
+        status=$(field exit_status "$tmp/run.json")
+        if [ "$status" != 0 ]
+        then
+            error "the program failed (exit status ${status:-unknown}, -1 if it was killed)"
+            continue
+        fi
+
+        seconds=$(field seconds "$tmp/compile.json")
+        printf '{"commit": "%s", "profile": "%s", "opt": "%s", "lines": %s, "compile_seconds": %s, "lines_per_sec": %s, "peak_rss_kb": %s, "insns": %s, "run_cycles": %s, "self_move": %s, "dead_write": %s, "add_zero": %s, "xor_zero": %s, "copy_chain": %s}\n' \
+            "$commit" "$profile" "$opt" "$lines" "$seconds" \
+            "$(awk -v l="$lines" -v s="$seconds" 'BEGIN { printf "%.0f", (s > 0) ? l / s : 0 }')" \
+            "$(field peak_rss_kb "$tmp/compile.json")" "$insns" "$(field cycles "$tmp/run.json")" \
+            "$(eliminated self-move)" "$(eliminated dead-write)" "$(eliminated add-zero)" "$(eliminated xor-zero)" \
+            "$(eliminated copy-chain)"
+    done
+done
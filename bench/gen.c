@@ -0,0 +1,135 @@
+// Seeded generator of et programs for the benchmarks. The same profile, seed and length always give the same program.
+//
+// USAGE: gen <deep|wide|compare|const> <seed> <lines>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEPTH 64
+
+typedef enum {
+    PROFILE_DEEP,
+    PROFILE_WIDE,
+    PROFILE_COMPARE,
+    PROFILE_CONST,
+} profile_t;
+
+static uint64_t rng_state;
+static unsigned long num_vars = 0;
+
+static uint64_t rng_next(void);
+static unsigned long rng_below(unsigned long bound);
+static void gen_leaf(profile_t profile);
+static void gen_expr(profile_t profile, unsigned depth);
+static const char *gen_operator(profile_t profile);
+
+int main(int argc, char **argv) {
+    if(argc != 4) {
+        fprintf(stderr, "USAGE: %s <deep|wide|compare|const> <seed> <lines>\n", argv[0]);
+        return 1;
+    }
+    profile_t profile;
+    if(strcmp(argv[1], "deep") == 0) {
+        profile = PROFILE_DEEP;
+    }
+    else if(strcmp(argv[1], "wide") == 0) {
+        profile = PROFILE_WIDE;
+    }
+    else if(strcmp(argv[1], "compare") == 0) {
+        profile = PROFILE_COMPARE;
+    }
+    else if(strcmp(argv[1], "const") == 0) {
+        profile = PROFILE_CONST;
+    }
+    else {
+        fprintf(stderr, "Unknown profile %s\n", argv[1]);
+        return 1;
+    }
+    // N.B. xorshift must never be seeded with 0
+    rng_state = strtoull(argv[2], NULL, 10) * 0x9E3779B97F4A7C15ull + 1;
+    unsigned long lines = strtoul(argv[3], NULL, 10);
+
+    for(unsigned long line = 0; line < lines; ++line) {
+        // The wide profile keeps declaring variables for half the program; the others stick with a handful.
+        bool declare = num_vars == 0 ||
+                       (profile == PROFILE_WIDE ? line < lines / 2 : (num_vars < 8 && rng_below(4) == 0));
+        if(declare) {
+            printf("int v%lu = ", num_vars);
+            gen_expr(profile, profile == PROFILE_DEEP ? 8 : 3);
+            ++num_vars;
+        }
+        else if(rng_below(5) == 0) {
+            printf("v%lu = ", rng_below(num_vars));
+            gen_expr(profile, profile == PROFILE_DEEP ? MAX_DEPTH : 4);
+        }
+        else {
+            gen_expr(profile, profile == PROFILE_DEEP ? MAX_DEPTH : 4);
+        }
+        putchar('\n');
+    }
+    return 0;
+}
+
+// xorshift64*
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned long rng_below(unsigned long bound) {
+    return bound == 0 ? 0 : (unsigned long) (rng_next() >> 32) % bound;
+}
+
+static void gen_leaf(profile_t profile) {
+    bool constant = num_vars == 0 || (profile == PROFILE_CONST ? rng_below(8) != 0 : rng_below(2) == 0);
+    if(constant) {
+        printf("%lu", rng_below(1000));
+    }
+    else {
+        printf("v%lu", rng_below(num_vars));
+    }
+}
+
+// Deep trees lean right (a + (b - (c + ...))) so that they get deep without getting huge.
+// N.B. Divisors are always nonzero constants, so that no program traps (and the optimizer has something to reduce).
+static void gen_expr(profile_t profile, unsigned depth) {
+    if(depth == 0 || (profile != PROFILE_DEEP && rng_below(3) == 0)) {
+        gen_leaf(profile);
+        return;
+    }
+    const char *operr = gen_operator(profile);
+    putchar('(');
+    if(strcmp(operr, "/") == 0 || strcmp(operr, "%") == 0) {
+        gen_expr(profile, depth - 1);
+        printf(" %s %lu", operr, rng_below(999) + 1);
+    }
+    else {
+        if(profile == PROFILE_DEEP) {
+            gen_leaf(profile);
+        }
+        else {
+            gen_expr(profile, depth - 1);
+        }
+        printf(" %s ", operr);
+        gen_expr(profile, depth - 1);
+    }
+    putchar(')');
+}
+
+static const char *gen_operator(profile_t profile) {
+    static const char *const arithmetic[] = { "+", "-" };
+    static const char *const multiplicative[] = { "*", "/", "%", "<<", ">>" };
+    static const char *const comparisons[] = { "[]", "][", "<", ">" };
+    if(profile == PROFILE_COMPARE ? rng_below(4) != 0 : rng_below(8) == 0) {
+        return comparisons[rng_below(4)];
+    }
+    if(rng_below(4) == 0) {
+        return multiplicative[rng_below(5)];
+    }
+    return arithmetic[rng_below(2)];
+}
@@ -0,0 +1,116 @@
+// Runs a command and reports, as JSON, how long it took, its peak RSS and (if the kernel lets us) how many CPU cycles
+// it spent, counted with perf_event_open. The command's own output goes to /dev/null, so the report is all there is on
+// stdout.
+//
+// USAGE: measure [-c] command [args...]
+//   -c   count cycles
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int open_cycle_counter(pid_t pid);
+
+int main(int argc, char **argv) {
+    int first_arg = 1;
+    bool count_cycles = false;
+    if(argc > 1 && strcmp(argv[1], "-c") == 0) {
+        count_cycles = true;
+        ++first_arg;
+    }
+    if(first_arg >= argc) {
+        fprintf(stderr, "USAGE: %s [-c] command [args...]\n", argv[0]);
+        return 1;
+    }
+
+    // The child waits on this until the counter is attached, so that it counts from the exec on.
+    int go[2];
+    if(pipe(go) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if(pid == 0) {
+        close(go[1]);
+        char ready;
+        if(read(go[0], &ready, 1) != 1) {
+            _exit(127);
+        }
+        close(go[0]);
+        int null = open("/dev/null", O_WRONLY);
+        if(null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+            perror("/dev/null");
+            _exit(127);
+        }
+        close(null);
+        execvp(argv[first_arg], &argv[first_arg]);
+        perror(argv[first_arg]);
+        _exit(127);
+    }
+
+    close(go[0]);
+    int counter = count_cycles ? open_cycle_counter(pid) : -1;
+    if(write(go[1], "", 1) != 1) {
+        perror("write");
+        return 1;
+    }
+    close(go[1]);
+
+    int status;
+    struct rusage usage;
+    while(wait4(pid, &status, 0, &usage) < 0) {
+        if(errno != EINTR) {
+            perror("wait4");
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long long cycles = -1;
+    if(counter >= 0) {
+        uint64_t value;
+        if(read(counter, &value, sizeof value) == sizeof value) {
+            cycles = (long long) value;
+        }
+        close(counter);
+    }
+
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("{\"seconds\": %.6f, \"peak_rss_kb\": %ld, \"cycles\": %lld, \"exit_status\": %d}\n", seconds,
+           usage.ru_maxrss, cycles, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+}
+
+// N.B. Returns -1 if counting isn't possible here (no PMU, or perf_event_paranoid says no)
+static int open_cycle_counter(pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
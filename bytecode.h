@@ -0,0 +1,14 @@
+#pragma once
+
+#include "parse_tree.h"
+
+#include <stdbool.h>
+
+// A second backend beside code_gen(): lowers each line straight from the parse tree (without any optimization) into
+// bytecode, runs it right away and prints its value, much like the JIT does. Cheap to start, and simple enough to serve
+// as the reference for what the x86 backend should compute. Returns NULL, or (without running anything) what is wrong
+// with the line: a variable declared twice or used without a declaration.
+const char *bytecode_line(const parse_node_t *expression);
+
+// With `interactive`, every value is written out as soon as it's printed, rather than in large chunks.
+void bytecode_configure(bool interactive);
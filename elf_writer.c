@@ -0,0 +1,228 @@
+#include "elf_writer.h"
+#include "output.h"
+#include "x86_encode.h"
+
+#include <elf.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ELF_TEXT_ALIGN ((size_t) 16)
+#define ELF_TABLE_ALIGN ((size_t) 8)
+#define ELF_EXEC_BASE ((Elf64_Addr) 0x400000)
+#define ELF_PAGE_LEN ((Elf64_Xword) 0x1000)
+
+// putint(int value): prints the value in decimal and a newline to stdout. The digits are built backwards in the red
+// zone below %rsp.
+// N.B. Only clobbers caller-saved registers (%rax, %rcx, %rdx, %rsi, %rdi, %r8, and %r11 in the system call)
+static const uint8_t putint_code[] = {
+    0x89, 0xF8,                         //     movl %edi, %eax
+    0x48, 0x8D, 0x74, 0x24, 0xFF,       //     leaq -1(%rsp), %rsi
+    0xC6, 0x06, 0x0A,                   //     movb $'\n', (%rsi)
+    0x89, 0xC1,                         //     movl %eax, %ecx
+    0x85, 0xC0,                         //     testl %eax, %eax
+    0x79, 0x02,                         //     jns 1f
+    0xF7, 0xD8,                         //     negl %eax
+    0x41, 0xB8, 0x0A, 0x00, 0x00, 0x00, // 1:  movl $10, %r8d
+    0x31, 0xD2,                         // 2:  xorl %edx, %edx
+    0x41, 0xF7, 0xF0,                   //     divl %r8d
+    0x83, 0xC2, 0x30,                   //     addl $'0', %edx
+    0x48, 0xFF, 0xCE,                   //     decq %rsi
+    0x88, 0x16,                         //     movb %dl, (%rsi)
+    0x85, 0xC0,                         //     testl %eax, %eax
+    0x75, 0xEF,                         //     jnz 2b
+    0x85, 0xC9,                         //     testl %ecx, %ecx
+    0x79, 0x06,                         //     jns 3f
+    0x48, 0xFF, 0xCE,                   //     decq %rsi
+    0xC6, 0x06, 0x2D,                   //     movb $'-', (%rsi)
+    0x48, 0x89, 0xE2,                   // 3:  movq %rsp, %rdx
+    0x48, 0x29, 0xF2,                   //     subq %rsi, %rdx
+    0xBF, 0x01, 0x00, 0x00, 0x00,       //     movl $1, %edi (stdout)
+    0xB8, 0x01, 0x00, 0x00, 0x00,       //     movl $1, %eax (SYS_write)
+    0x0F, 0x05,                         //     syscall
+    0xC3,                               //     ret
+};
+
+static const uint8_t ret_code[] = { 0xC3 };
+static const uint8_t syscall_code[] = { 0x0F, 0x05 };
+
+#define SYS_EXIT 60
+
+// Names of the object's sections, in section header order (after the null section)
+enum {
+    SECTION_TEXT = 1,
+    SECTION_NOTE_GNU_STACK,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_COUNT,
+};
+
+// N.B. Each name's offset is where it starts in here
+static const char shstrtab[] = "\0.text\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+static const char strtab[] = "\0putint\0main";
+#define STRTAB_PUTINT ((Elf64_Word) 1)
+#define STRTAB_MAIN ((Elf64_Word) 8)
+
+static size_t build_text(const insn_buffer_t *program, code_buffer_t *text);
+static void encode_footer(code_buffer_t *text);
+static Elf64_Ehdr elf_header(Elf64_Half type);
+static Elf64_Word section_name(const char *name);
+static void output_padding(size_t from, size_t align);
+static size_t align_up(size_t offset, size_t align);
+
+void elf_write_object(const insn_buffer_t *program) {
+    code_buffer_t text = CODE_BUFFER_INIT;
+    size_t main_offset = build_text(program, &text);
+
+    const Elf64_Sym symbols[] = {
+        { .st_name = 0 },
+        { .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = SECTION_TEXT },
+        { .st_name = STRTAB_PUTINT, .st_info = ELF64_ST_INFO(STB_LOCAL, STT_FUNC), .st_shndx = SECTION_TEXT,
+          .st_value = 0, .st_size = sizeof putint_code },
+        // N.B. Globals have to come after all the locals
+        { .st_name = STRTAB_MAIN, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), .st_shndx = SECTION_TEXT,
+          .st_value = main_offset, .st_size = text.len - main_offset },
+    };
+    const Elf64_Word first_global = 3;
+
+    size_t text_offset = sizeof(Elf64_Ehdr);
+    size_t symtab_offset = align_up(text_offset + text.len, ELF_TABLE_ALIGN);
+    size_t strtab_offset = symtab_offset + sizeof symbols;
+    size_t names_offset = strtab_offset + sizeof strtab;
+    size_t shdrs_offset = align_up(names_offset + sizeof shstrtab, ELF_TABLE_ALIGN);
+
+    const Elf64_Shdr section_headers[SECTION_COUNT] = {
+        { .sh_type = SHT_NULL },
+        [SECTION_TEXT] = { .sh_name = section_name(".text"), .sh_type = SHT_PROGBITS,
+                           .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_offset = text_offset, .sh_size = text.len,
+                           .sh_addralign = ELF_TEXT_ALIGN },
+        // Its presence tells the linker we don't need an executable stack.
+        [SECTION_NOTE_GNU_STACK] = { .sh_name = section_name(".note.GNU-stack"), .sh_type = SHT_PROGBITS,
+                                     .sh_offset = symtab_offset, .sh_addralign = 1 },
+        [SECTION_SYMTAB] = { .sh_name = section_name(".symtab"), .sh_type = SHT_SYMTAB, .sh_offset = symtab_offset,
+                             .sh_size = sizeof symbols, .sh_link = SECTION_STRTAB, .sh_info = first_global,
+                             .sh_addralign = ELF_TABLE_ALIGN, .sh_entsize = sizeof(Elf64_Sym) },
+        [SECTION_STRTAB] = { .sh_name = section_name(".strtab"), .sh_type = SHT_STRTAB, .sh_offset = strtab_offset,
+                             .sh_size = sizeof strtab, .sh_addralign = 1 },
+        [SECTION_SHSTRTAB] = { .sh_name = section_name(".shstrtab"), .sh_type = SHT_STRTAB,
+                               .sh_offset = names_offset, .sh_size = sizeof shstrtab, .sh_addralign = 1 },
+    };
+
+    Elf64_Ehdr header = elf_header(ET_REL);
+    header.e_shoff = shdrs_offset;
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = SECTION_COUNT;
+    header.e_shstrndx = SECTION_SHSTRTAB;
+
+    // N.B. The structures go out as they are laid out in memory, which is only right because we run on x86-64 too.
+    output_bytes((const char *) &header, sizeof header);
+    output_bytes((const char *) text.bytes, text.len);
+    output_padding(text_offset + text.len, ELF_TABLE_ALIGN);
+    output_bytes((const char *) symbols, sizeof symbols);
+    output_bytes(strtab, sizeof strtab);
+    output_bytes(shstrtab, sizeof shstrtab);
+    output_padding(names_offset + sizeof shstrtab, ELF_TABLE_ALIGN);
+    output_bytes((const char *) section_headers, sizeof section_headers);
+
+    code_buffer_free(&text);
+}
+
+void elf_write_executable(const insn_buffer_t *program) {
+    code_buffer_t text = CODE_BUFFER_INIT;
+    size_t main_offset = build_text(program, &text);
+
+    // _start: call main; movl %eax, %edi; movl $SYS_exit, %eax; syscall
+    size_t start_offset = text.len;
+    x86_encode(&text, &(insn_t) { .opcode = INSN_CALL }, main_offset);
+    x86_encode(&text, &(insn_t) { .opcode = INSN_MOVL, .src = insn_reg(X86_RAX), .dst = insn_reg(X86_RDI) }, 0);
+    x86_encode(&text, &(insn_t) { .opcode = INSN_MOVL, .src = insn_imm(SYS_EXIT), .dst = insn_reg(X86_RAX) }, 0);
+    code_buffer_append(&text, syscall_code, sizeof syscall_code);
+
+    size_t headers_len = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+    size_t text_offset = align_up(headers_len, ELF_TEXT_ALIGN);
+    size_t file_len = text_offset + text.len;
+
+    // The whole file is mapped as one read-only, executable segment.
+    Elf64_Phdr segment = {
+        .p_type = PT_LOAD,
+        .p_flags = PF_R | PF_X,
+        .p_offset = 0,
+        .p_vaddr = ELF_EXEC_BASE,
+        .p_paddr = ELF_EXEC_BASE,
+        .p_filesz = file_len,
+        .p_memsz = file_len,
+        .p_align = ELF_PAGE_LEN,
+    };
+
+    Elf64_Ehdr header = elf_header(ET_EXEC);
+    header.e_entry = ELF_EXEC_BASE + text_offset + start_offset;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 1;
+
+    output_bytes((const char *) &header, sizeof header);
+    output_bytes((const char *) &segment, sizeof segment);
+    output_padding(headers_len, ELF_TEXT_ALIGN);
+    output_bytes((const char *) text.bytes, text.len);
+
+    code_buffer_free(&text);
+}
+
+// putint, then main. Returns main's offset.
+static size_t build_text(const insn_buffer_t *program, code_buffer_t *text) {
+    code_buffer_append(text, putint_code, sizeof putint_code);
+    size_t main_offset = text->len;
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        x86_encode(text, &program->insns[idx], 0);
+    }
+    encode_footer(text);
+    return main_offset;
+}
+
+// The same as test/compile_helper's: movl %eax, %edi; call putint; movl $0, %eax; ret
+static void encode_footer(code_buffer_t *text) {
+    x86_encode(text, &(insn_t) { .opcode = INSN_MOVL, .src = insn_reg(X86_RAX), .dst = insn_reg(X86_RDI) }, 0);
+    x86_encode(text, &(insn_t) { .opcode = INSN_CALL }, 0);
+    x86_encode(text, &(insn_t) { .opcode = INSN_MOVL, .src = insn_imm(0), .dst = insn_reg(X86_RAX) }, 0);
+    code_buffer_append(text, ret_code, sizeof ret_code);
+}
+
+static Elf64_Ehdr elf_header(Elf64_Half type) {
+    Elf64_Ehdr header = {
+        .e_ident = {
+            [EI_MAG0] = ELFMAG0,
+            [EI_MAG1] = ELFMAG1,
+            [EI_MAG2] = ELFMAG2,
+            [EI_MAG3] = ELFMAG3,
+            [EI_CLASS] = ELFCLASS64,
+            [EI_DATA] = ELFDATA2LSB,
+            [EI_VERSION] = EV_CURRENT,
+            [EI_OSABI] = ELFOSABI_SYSV,
+        },
+        .e_type = type,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+    };
+    return header;
+}
+
+static Elf64_Word section_name(const char *name) {
+    // Skip the leading empty name, which would otherwise match everything's terminator.
+    for(size_t offset = 1; offset < sizeof shstrtab; offset += strlen(&shstrtab[offset]) + 1) {
+        if(strcmp(&shstrtab[offset], name) == 0) {
+            return (Elf64_Word) offset;
+        }
+    }
+    return 0;
+}
+
+static void output_padding(size_t from, size_t align) {
+    static const char zeros[ELF_TEXT_ALIGN] = { 0 };
+    output_bytes(zeros, align_up(from, align) - from);
+}
+
+static size_t align_up(size_t offset, size_t align) {
+    return (offset + align - 1) / align * align;
+}
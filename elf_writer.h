@@ -0,0 +1,13 @@
+#pragma once
+
+#include "insn_buffer.h"
+
+// Both wrap the (register-allocated) program in a main() that prints its result with putint and returns 0, just like
+// test/compile_helper does, and write the result as ELF64 through output.h. putint comes built in: it makes the write
+// system call itself, so nothing needs libc.
+
+// A relocatable object defining main, for linking into a C program (e.g. `gcc -o prog prog.o`).
+void elf_write_object(const insn_buffer_t *program);
+
+// A static executable of its own, whose _start calls main and exits with its result.
+void elf_write_executable(const insn_buffer_t *program);
@@ -1,36 +1,103 @@
 %code requires {
     #include "parse_tree.h"
+
+    // One input being compiled (see compile_unit())
+    typedef struct et_unit et_unit_t;
+
+    // N.B. The scanner defines this as well, under the same guard.
+    #ifndef YY_TYPEDEF_YY_SCANNER_T
+    #define YY_TYPEDEF_YY_SCANNER_T
+    typedef void *yyscan_t;
+    #endif
+}
+
+%code provides {
+    int yylex(YYSTYPE *lvalp, yyscan_t scanner);
+    void yyerror(et_unit_t *unit, yyscan_t scanner, const char *s);
 }
 
+%define api.pure full
+%lex-param { yyscan_t scanner }
+%parse-param { et_unit_t *unit } { yyscan_t scanner }
+
 %{
+    #include "arena.h"
+    #include "batch.h"
+    #include "bytecode.h"
     #include "et_compiler.h"
+    #include "intern.h"
+    #include "output.h"
+    #include "peephole.h"
+    #include "source_map.h"
+    #include "stats.h"
+    #include "thread_local.h"
 
+    #include <assert.h>
+    #include <getopt.h>
     #include <stdarg.h>
     #include <stdio.h>
     #include <stdlib.h>
+    #include <string.h>
+    #include <unistd.h>
 
-    void yyerror(char *s);
-    int yylex(void);
+    // The parser's stacks live on the heap and grow as needed, so there is no reason to give up on deep nesting early.
+    #define YYMAXDEPTH (1 << 28)
 %}
 
+%code {
+    struct et_unit {
+        // For error messages (NULL for standard input)
+        const char *name;
+        // Run everything through the bytecode interpreter instead of the compiler
+        bool use_bytecode;
+        // Whether the input is a file the scanner works on in place
+        bool mapped;
+        source_map_t source;
+    };
+
+    // The scanner's interface (see et.l.l)
+    int yylex_init_extra(et_unit_t *unit, yyscan_t *scanner);
+    void yyset_in(FILE *in, yyscan_t scanner);
+    struct yy_buffer_state *yy_scan_buffer(char *base, size_t size, yyscan_t scanner);
+    char *yyget_text(yyscan_t scanner);
+    int yylex_destroy(yyscan_t scanner);
+
+    static ET_THREAD_LOCAL arena_t parse_line_arena = ARENA_INIT;
+    // The unit this thread is parsing, for the errors raised outside of the parser
+    static ET_THREAD_LOCAL et_unit_t *parse_unit = NULL;
+
+    // Counts a node the grammar built (rather than one the folder made up later) for --stats.
+    static const parse_node_t *parsed(const parse_node_t *node) {
+        stats_count_node(node->type);
+        return node;
+    }
+}
+
 %union {
     int iValue;
     const parse_node_t *oValue;
-    const char *sValue;
+    intern_id_t idValue;
 }
 
 %token <iValue> INTEGER
-%token <sValue> VARIABLE
+%token <idValue> VARIABLE
 %token INTKEYWORD
 %token EQUAL NEQUAL
+%token SHL SHR
 %token BADLEX
 
 %type <oValue> expr logic
 
+%right '='
 %left '+' '-' EQUAL NEQUAL '<' '>'
+%left '*' '/' '%' SHL SHR
 
 %%
 
+program:
+    input       { if(!unit->use_bytecode) code_gen_finish(); }
+    ;
+
 input:
      %empty
      | input line
@@ -39,69 +106,91 @@ input:
 line:
     '\n'
     | BADLEX '\n'   { YYABORT; }
-    | expr '\n'     { code_gen($1); }
+    | expr '\n'     {
+                      const char *error = unit->use_bytecode ? bytecode_line($1) : code_gen($1);
+                      parse_line_reset();
+                      if(unit->mapped) {
+                          source_map_release(&unit->source, yyget_text(scanner));
+                      }
+                      if(error != NULL) {
+                          yyerror(unit, scanner, error);
+                          YYABORT;
+                      }
+                    }
     ;
 
 logic:
     expr EQUAL expr     {
-                      $$ = parse_node_operation(OP_EQUL,  2, $1, $3);
+                      $$ = parsed(parse_node_operation(OP_EQUL,  2, $1, $3));
                         }
     | expr NEQUAL expr  {
-                      $$ = parse_node_operation(OP_NEQL, 2, $1, $3);
+                      $$ = parsed(parse_node_operation(OP_NEQL, 2, $1, $3));
                         }
-    | expr '<' expr  { $$ = parse_node_operation(OP_LESS, 2, $1, $3); }
-    | expr '>' expr  { $$ = parse_node_operation(OP_GREA, 2, $1, $3); }
+    | expr '<' expr  { $$ = parsed(parse_node_operation(OP_LESS, 2, $1, $3)); }
+    | expr '>' expr  { $$ = parsed(parse_node_operation(OP_GREA, 2, $1, $3)); }
     ;
 
 
 expr:
-    INTEGER         { $$ = parse_node_int($1); }
-    | INTKEYWORD VARIABLE '=' expr { $$ = parse_node_var(true, true, $2, $4); }
-    | VARIABLE '=' expr { $$ = parse_node_var(false, true, $1, $3); }
-    | VARIABLE      { $$ = parse_node_var(false, false, $1, NULL); }
+    INTEGER         { $$ = parsed(parse_node_int($1)); }
+    | INTKEYWORD VARIABLE '=' expr { $$ = parsed(parse_node_var(true, true, $2, $4)); }
+    | VARIABLE '=' expr { $$ = parsed(parse_node_var(false, true, $1, $3)); }
+    | VARIABLE      { $$ = parsed(parse_node_var(false, false, $1, NULL)); }
     | logic         { $$ = $1; }
-    | expr '+' expr { $$ = parse_node_operation(OP_ADD2, 2, $1, $3); }
-    | expr '-' expr { $$ = parse_node_operation(OP_SUB2, 2, $1, $3); }
+    | expr '+' expr { $$ = parsed(parse_node_operation(OP_ADD2, 2, $1, $3)); }
+    | expr '-' expr { $$ = parsed(parse_node_operation(OP_SUB2, 2, $1, $3)); }
+    | expr '*' expr { $$ = parsed(parse_node_operation(OP_MUL2, 2, $1, $3)); }
+    | expr '/' expr { $$ = parsed(parse_node_operation(OP_DIV2, 2, $1, $3)); }
+    | expr '%' expr { $$ = parsed(parse_node_operation(OP_MOD2, 2, $1, $3)); }
+    | expr SHL expr { $$ = parsed(parse_node_operation(OP_SHL2, 2, $1, $3)); }
+    | expr SHR expr { $$ = parsed(parse_node_operation(OP_SHR2, 2, $1, $3)); }
     | '(' expr ')'  { $$ = $2; }
     ;
 
 %%
 
 const parse_node_t *parse_node_int(int value) {
-    parse_node_t *node = malloc(sizeof(parse_node_t));
+    parse_node_t *node = arena_alloc(&parse_line_arena, sizeof(parse_node_t));
     if(node == NULL) {
-        yyerror("Out of memory");
+        yyerror(parse_unit, NULL, "Out of memory");
     }
     node->type = NODE_TYPE_INT;
+    node->registers = 0;
+    node->assigns = false;
     node->contents.integer.value = value;
     return node;
 }
 
-const parse_node_t *parse_node_var(bool declaration, bool assignment, const char *id, const parse_node_t *subexpr) {
-    parse_node_t *node = malloc(sizeof(parse_node_t));
+const parse_node_t *parse_node_var(bool declaration, bool assignment, intern_id_t id, const parse_node_t *subexpr) {
+    parse_node_t *node = arena_alloc(&parse_line_arena, sizeof(parse_node_t));
     if(node == NULL) {
-        yyerror("Out of memory");
+        yyerror(parse_unit, NULL, "Out of memory");
     }
     node->type = NODE_TYPE_VAR;
     node->contents.variable.identifier = id;
     node->contents.variable.declaration = declaration;
     node->contents.variable.assignment = assignment;
     node->contents.variable.subexpr = subexpr;
+    if(assignment) {
+        node->registers = subexpr->registers ? subexpr->registers : 1;
+        node->assigns = true;
+    }
+    else {
+        node->registers = 0;
+        node->assigns = false;
+    }
     return node;
 }
 
 const parse_node_t *parse_node_operation(parse_node_operator_t operr, size_t num_ops, const parse_node_t *node0, ...) {
-    parse_node_t *node = malloc(sizeof(parse_node_t));
+    parse_node_t *node = arena_alloc(&parse_line_arena, sizeof(parse_node_t));
     if(node == NULL) {
-        yyerror("Out of memory");
+        yyerror(parse_unit, NULL, "Out of memory");
     }
     node->type = NODE_TYPE_OPERATION;
     node->contents.operation.operr = operr;
+    assert(num_ops <= PARSE_NODE_MAX_OPS);
     node->contents.operation.num_ops = num_ops;
-    node->contents.operation.ops = malloc(num_ops * sizeof(const parse_node_t *));
-    if(node->contents.operation.ops == NULL) {
-        yyerror("Out of memory");
-    }
     va_list list;
     va_start(list, node0);
     const parse_node_t *curr_node = node0;
@@ -111,14 +200,322 @@ const parse_node_t *parse_node_operation(parse_node_operator_t operr, size_t num
         node->contents.operation.ops[idx] = curr_node;
     }
     va_end(list);
+
+    assert(num_ops == 2);
+    const parse_node_t *lhs = node->contents.operation.ops[0];
+    const parse_node_t *rhs = node->contents.operation.ops[1];
+    // Whichever side goes first holds its result while the other is computed, so it only costs an extra register
+    // when both need the same number.
+    if(lhs->registers == rhs->registers) {
+        node->registers = lhs->registers + 1;
+    }
+    else {
+        node->registers = lhs->registers > rhs->registers ? lhs->registers : rhs->registers;
+    }
+    node->assigns = lhs->assigns || rhs->assigns;
     return node;
 }
 
-void yyerror(char *s) {
-    fprintf(stderr, "ERROR: %s\n", s);
+void parse_line_reset(void) {
+    arena_reset(&parse_line_arena);
+}
+
+void yyerror(et_unit_t *unit, yyscan_t scanner, const char *s) {
+    const char *name = (unit != NULL && unit->name != NULL) ? unit->name : NULL;
+    fprintf(stderr, "%s%sERROR: %s\n", name ? name : "", name ? ": " : "", s);
+}
+
+// Compiles (or with use_bytecode, runs) one input into the current output, and returns yyparse()'s result.
+static int compile_unit(FILE *in, const char *name, bool use_bytecode) {
+    et_unit_t unit = { .name = name, .use_bytecode = use_bytecode };
+    yyscan_t scanner;
+    if(yylex_init_extra(&unit, &scanner) != 0) {
+        yyerror(&unit, NULL, "Out of memory");
+        return 1;
+    }
+    // Regular files are scanned right where they're mapped; anything else (a pipe, a terminal) is read bit by bit.
+    unit.mapped = source_map_open(fileno(in), &unit.source);
+    if(unit.mapped) {
+        yy_scan_buffer(unit.source.bytes, unit.source.len + SOURCE_MAP_SENTINEL_LEN, scanner);
+    }
+    else {
+        yyset_in(in, scanner);
+    }
+
+    // Whatever the last unit on this thread left behind
+    intern_reset();
+    code_gen_reset();
+    parse_line_reset();
+
+    parse_unit = &unit;
+    int res = yyparse(&unit, scanner);
+    if(!use_bytecode) {
+        // Even after an error, the lines before it get to run.
+        code_gen_run_waiting();
+    }
+    parse_unit = NULL;
+    yylex_destroy(scanner);
+    if(unit.mapped) {
+        source_map_close(&unit.source);
+    }
+    return res;
 }
 
-int main(void)
+typedef struct {
+    char **inputs;
+    // Each input's output path (see batch_output_path())
+    char **outputs;
+    code_gen_options_t options;
+} batch_job_t;
+
+// The input's name with its extension replaced by the format's, in output_dir if there is one.
+static char *batch_output_path(const char *input, const char *output_dir, x86_output_format_t format) {
+    const char *base = input;
+    const char *slash = strrchr(input, '/');
+    if(output_dir != NULL && slash != NULL) {
+        base = slash + 1;
+    }
+    const char *dot = strrchr(base, '.');
+    size_t base_len = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t) (dot - base) : strlen(base);
+
+    const char *extension = "";
+    switch(format) {
+        case X86_OUTPUT_ASM:
+            extension = ".s";
+            break;
+        case X86_OUTPUT_OBJECT:
+            extension = ".o";
+            break;
+        case X86_OUTPUT_EXECUTABLE:
+            // Executables go without, unless that would overwrite the input.
+            extension = base[base_len] == '\0' ? ".out" : "";
+            break;
+        case X86_OUTPUT_JIT:
+            assert(false);
+            break;
+    }
+
+    size_t dir_len = output_dir != NULL ? strlen(output_dir) + 1 : 0;
+    char *path = malloc(dir_len + base_len + strlen(extension) + 1);
+    // TODO: Compiler error if out of memory
+    assert(path != NULL);
+    if(output_dir != NULL) {
+        strcpy(path, output_dir);
+        strcat(path, "/");
+    }
+    else {
+        path[0] = '\0';
+    }
+    strncat(path, base, base_len);
+    strcat(path, extension);
+    return path;
+}
+
+static int compare_strings(const void *lhs, const void *rhs) {
+    return strcmp(*(char *const *) lhs, *(char *const *) rhs);
+}
+
+// Works out every input's output path, and returns NULL (after saying why) if two inputs would write the same one.
+static char **batch_output_paths(char **inputs, size_t num_inputs, const char *output_dir, x86_output_format_t format) {
+    char **outputs = malloc(num_inputs * sizeof(char *));
+    char **sorted = malloc(num_inputs * sizeof(char *));
+    // TODO: Compiler error if out of memory
+    assert(outputs != NULL && sorted != NULL);
+    for(size_t idx = 0; idx < num_inputs; ++idx) {
+        outputs[idx] = batch_output_path(inputs[idx], output_dir, format);
+        sorted[idx] = outputs[idx];
+    }
+
+    qsort(sorted, num_inputs, sizeof(char *), compare_strings);
+    for(size_t idx = 1; idx < num_inputs; ++idx) {
+        if(strcmp(sorted[idx - 1], sorted[idx]) == 0) {
+            fprintf(stderr, "More than one input would be compiled to %s\n", sorted[idx]);
+            for(size_t output = 0; output < num_inputs; ++output) {
+                free(outputs[output]);
+            }
+            free(outputs);
+            outputs = NULL;
+            break;
+        }
+    }
+    free(sorted);
+    return outputs;
+}
+
+static int compile_batch_unit(size_t unit, void *context) {
+    const batch_job_t *job = context;
+    const char *input = job->inputs[unit];
+    const char *output_path = job->outputs[unit];
+    FILE *in = fopen(input, "r");
+    if(in == NULL) {
+        perror(input);
+        return 1;
+    }
+    if(!output_open(output_path, job->options.format == X86_OUTPUT_EXECUTABLE)) {
+        perror(output_path);
+        fclose(in);
+        return 1;
+    }
+
+    // N.B. The options are per thread like everything else, and this may be the thread's first unit.
+    code_gen_configure(&job->options);
+    int res = compile_unit(in, input, false);
+    output_close();
+    // Don't leave half a program behind for a build to pick up.
+    if(res != 0 && unlink(output_path) != 0) {
+        perror(output_path);
+    }
+    fclose(in);
+    return res;
+}
+
+int main(int argc, char **argv)
 {
-    return yyparse();
+    code_gen_options_t options = {
+        .format = X86_OUTPUT_ASM,
+        .fold_constants = true,
+        .optimize_ir = true,
+        .peephole_window = 2,
+        .report_passes = false,
+    };
+    // Long options only; their values are outside the range of the short ones.
+    enum {
+        OPT_STATS = 256,
+        OPT_TRACE,
+        OPT_NO_FOLD,
+    };
+    static const struct option long_options[] = {
+        { .name = "stats", .has_arg = no_argument, .val = OPT_STATS },
+        { .name = "trace", .has_arg = required_argument, .val = OPT_TRACE },
+        { .name = "no-fold", .has_arg = no_argument, .val = OPT_NO_FOLD },
+        { 0 },
+    };
+    int opt;
+    const char *output_path = NULL;
+    bool use_bytecode = false;
+    bool report_stats = false;
+    const char *trace_path = NULL;
+    bool no_fold = false;
+    long num_threads = 0;
+    while((opt = getopt_long(argc, argv, "f:j:O:o:pw:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case OPT_STATS:
+                report_stats = true;
+                break;
+            case OPT_TRACE:
+                trace_path = optarg;
+                break;
+            case OPT_NO_FOLD:
+                no_fold = true;
+                break;
+            case 'f':
+                if(strcmp(optarg, "asm") == 0) {
+                    options.format = X86_OUTPUT_ASM;
+                }
+                else if(strcmp(optarg, "obj") == 0) {
+                    options.format = X86_OUTPUT_OBJECT;
+                }
+                else if(strcmp(optarg, "exe") == 0) {
+                    options.format = X86_OUTPUT_EXECUTABLE;
+                }
+                else if(strcmp(optarg, "jit") == 0) {
+                    options.format = X86_OUTPUT_JIT;
+                }
+                else if(strcmp(optarg, "vm") == 0) {
+                    use_bytecode = true;
+                }
+                else {
+                    fprintf(stderr, "Unknown output format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                num_threads = atol(optarg);
+                break;
+            case 'O':
+                options.fold_constants = atoi(optarg) > 0;
+                options.optimize_ir = atoi(optarg) > 0;
+                options.peephole_window = atoi(optarg) > 0 ? options.peephole_window : 0;
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'w': {
+                long window = atol(optarg);
+                if(window < 0 || window > (long) PEEPHOLE_MAX_WINDOW) {
+                    fprintf(stderr, "The peephole window goes from 0 to %zu\n", PEEPHOLE_MAX_WINDOW);
+                    return 1;
+                }
+                options.peephole_window = (size_t) window;
+                break;
+            }
+            case 'p':
+                options.report_passes = true;
+                break;
+            default:
+                fprintf(stderr, "USAGE: %s [-f asm|obj|exe|jit|vm] [-O level] [-o output] [-p] "
+                                "[-w peephole window (0-2)] [--no-fold] [--stats] [--trace=file] [-j threads] "
+                                "[input...]\n", argv[0]);
+                return 1;
+        }
+    }
+    // N.B. After the loop, so that a later -O doesn't turn folding back on
+    if(no_fold) {
+        options.fold_constants = false;
+    }
+
+    if(optind < argc) {
+        // Batch mode: every input is compiled into a file of its own, and -o names the directory they go in.
+        if(use_bytecode || options.format == X86_OUTPUT_JIT) {
+            fprintf(stderr, "-f jit and -f vm run a single program from standard input\n");
+            return 1;
+        }
+        if(report_stats || trace_path != NULL) {
+            fprintf(stderr, "--stats and --trace only cover a single program from standard input\n");
+            return 1;
+        }
+        if(num_threads <= 0) {
+            num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        options.interactive = false;
+        size_t num_inputs = (size_t) (argc - optind);
+        char **outputs = batch_output_paths(argv + optind, num_inputs, output_path, options.format);
+        if(outputs == NULL) {
+            return 1;
+        }
+        batch_job_t job = { .inputs = argv + optind, .outputs = outputs, .options = options };
+        size_t failures = batch_run(num_inputs, num_threads > 0 ? (size_t) num_threads : 1, compile_batch_unit, &job);
+        for(size_t idx = 0; idx < num_inputs; ++idx) {
+            free(outputs[idx]);
+        }
+        free(outputs);
+        return failures != 0;
+    }
+
+    if(output_path != NULL && !output_open(output_path, options.format == X86_OUTPUT_EXECUTABLE)) {
+        perror(output_path);
+        return 1;
+    }
+    options.interactive = isatty(STDIN_FILENO);
+    code_gen_configure(&options);
+    bytecode_configure(options.interactive);
+    if(report_stats || trace_path != NULL) {
+        stats_enable(trace_path != NULL);
+    }
+
+    stats_phase_push(STATS_PHASE_PARSE);
+    int res = compile_unit(stdin, NULL, use_bytecode);
+    stats_phase_pop();
+    stats_phase_push(STATS_PHASE_WRITE);
+    output_close();
+    stats_phase_pop();
+
+    if(report_stats) {
+        stats_report(stderr);
+    }
+    if(trace_path != NULL && !stats_write_trace(trace_path)) {
+        perror(trace_path);
+        return 1;
+    }
+    return res;
 }
@@ -1,333 +1,547 @@
 #include "et_compiler.h"
+#include "intern.h"
+#include "ir.h"
+#include "ir_pass.h"
+#include "jit.h"
+#include "jit_lanes.h"
 #include "parse_tree.h"
-#include "symbol_memory.h"
+#include "stats.h"
+#include "thread_local.h"
+#include "x86_emit.h"
 
 #include <assert.h>
-#include <search.h>
 #include <stdbool.h>
 #include <stddef.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define VAR_HASHTAB_LEN ((size_t) 64)
+#define INIT_VAR_BINDINGS_LEN ((size_t) 64)
+#define VAR_BINDINGS_GROWTH_FACTOR ((size_t) 2)
+#define INIT_WALK_STACK_LEN ((size_t) 64)
+#define WALK_STACK_GROWTH_FACTOR ((size_t) 2)
 
-// N.B. We're storing the symbol_table_index_t s as casted void * s
-static struct hsearch_data var_hashtab;
-static bool var_hashtab_has_been_initialized = false;
+// What we know about a variable: whether it has been declared, the IR value it currently names (its version) and the
+// unit that value belongs to, and its value if that is known at compile time.
+typedef struct {
+    bool declared;
+    bool has_version;
+    ir_value_t version;
+    uint32_t version_unit;
+    // The last unit that assigned the variable (see line_stores)
+    uint32_t stored_unit;
+    bool value_known;
+    int value;
+} var_binding_t;
+
+// Indexed by the identifiers' intern IDs, which are dense, so this is never much bigger than the number of variables.
+static ET_THREAD_LOCAL var_binding_t *var_bindings = NULL;
+static ET_THREAD_LOCAL size_t var_bindings_len = 0;
+
+static ET_THREAD_LOCAL code_gen_options_t code_gen_options = {
+    .format = X86_OUTPUT_ASM,
+    .fold_constants = true,
+    .optimize_ir = true,
+    .peephole_window = 2,
+    .report_passes = false,
+};
+
+// The whole program is lowered into IR first, so that it can be optimized before any x86 is emitted. Except for the
+// JIT, which compiles and runs every line as a unit of its own: then variables are kept in slots (indexed by intern ID)
+// between lines, and a version is only good within the unit that defined it.
+static ET_THREAD_LOCAL ir_program_t program_ir = IR_PROGRAM_INIT;
+static ET_THREAD_LOCAL uint32_t code_gen_unit = 0;
 
-// N.B. Associated functions return indices that are either symbol_table_index_t s or literal integers,
-// depending on the verdict of questionable_return_props() operating on the child node's type.
-typedef union {
-    symbol_table_index_t indirect;
-    int direct;
-} questionable_return_t;
+// The variables the current JIT line assigns, which have to be stored back into their slots at its end
+static ET_THREAD_LOCAL intern_id_t *line_stores = NULL;
+static ET_THREAD_LOCAL size_t line_stores_len = 0;
+static ET_THREAD_LOCAL size_t line_stores_cap = 0;
 
-// Tag for the above type, provided by questionable_return_props()
+// The value of the final line is the program's result, and it has to end up in %eax for the caller.
+static ET_THREAD_LOCAL bool last_line_result_valid = false;
+static ET_THREAD_LOCAL ir_operand_t last_line_result;
+
+// Both walks over the parse tree (folding and lowering) keep their work on these heap stacks instead of recursing, so
+// that however deeply an expression nests, it only costs memory. A node is revisited once after each of its children;
+// `stage` counts how many of them have been pushed, and their results pile up on the walk's own results stack.
 typedef struct {
-    bool indirect;
-    bool cleanup;
-} questionable_properties_t;
-
-static questionable_properties_t questionable_return_props(parse_node_tag_t node_type);
-static questionable_return_t code_gen_rec(const parse_node_t *expression);
-static symbol_table_index_t code_variable(const parse_node_var_t *variable);
-static symbol_table_index_t code_operate(const parse_node_operation_t *operation);
-static const char * code_gen_op_to_mnem(parse_node_operator_t operr);
-
-void code_gen(const parse_node_t *expression) {
-    questionable_return_t ex_ret = code_gen_rec(expression);
-    questionable_properties_t what_i_need_to_know = questionable_return_props(expression->type);
-    if(what_i_need_to_know.indirect && what_i_need_to_know.cleanup) {
-        symbol_del(ex_ret.indirect);
+    const parse_node_t *node;
+    size_t stage;
+    // Variables: the binding looked up before the subexpression
+    var_binding_t *binding;
+    // Operations: whether the right operand goes first
+    bool swapped;
+} walk_frame_t;
+
+static ET_THREAD_LOCAL walk_frame_t *walk_frames = NULL;
+static ET_THREAD_LOCAL size_t walk_frames_len = 0;
+// Why the walk gave up, if it did
+static ET_THREAD_LOCAL const char *walk_error = NULL;
+static ET_THREAD_LOCAL size_t walk_frames_cap = 0;
+static ET_THREAD_LOCAL const parse_node_t **fold_results = NULL;
+static ET_THREAD_LOCAL size_t fold_results_len = 0;
+static ET_THREAD_LOCAL size_t fold_results_cap = 0;
+static ET_THREAD_LOCAL ir_operand_t *code_results = NULL;
+static ET_THREAD_LOCAL size_t code_results_len = 0;
+static ET_THREAD_LOCAL size_t code_results_cap = 0;
+
+static void var_bindings_reserve(size_t len);
+static var_binding_t *var_binding_find(intern_id_t identifier);
+static var_binding_t *var_binding_declare(intern_id_t identifier);
+static var_binding_t *var_binding_enter(const parse_node_var_t *variable);
+// The binding a variable node refers to, declaring it first if that's what the node does. N.B. NULL (with walk_error
+// set) if the node declares a variable twice or uses one that was never declared, or the JIT has no slot for it
+static var_binding_t *var_binding_enter(const parse_node_var_t *variable) {
+    if(code_gen_options.format == X86_OUTPUT_JIT && variable->identifier >= JIT_MAX_VARIABLES) {
+        walk_error = "Too many variables";
+        return NULL;
     }
+    if(variable->declaration) {
+        return var_binding_declare(variable->identifier);
+    }
+    var_binding_t *binding = var_binding_find(variable->identifier);
+    if(binding == NULL) {
+        walk_error = "Undeclared variable";
+    }
+    return binding;
 }
 
-static questionable_properties_t questionable_return_props(parse_node_tag_t node_type) {
-    switch(node_type) {
-        case NODE_TYPE_INT: {
-            return (questionable_properties_t) { .indirect = false, .cleanup = false };
-        }
-        case NODE_TYPE_VAR: {
-            return (questionable_properties_t) { .indirect = true, .cleanup = true };
-        }
-        case NODE_TYPE_OPERATION: {
-            return (questionable_properties_t) { .indirect = true, .cleanup = true };
-        }
-        default: {
-            assert(false);
-            return (questionable_properties_t) { .indirect = false, .cleanup = false };
+static bool var_binding_has_version(const var_binding_t *binding);
+static void line_store_add(intern_id_t identifier, var_binding_t *binding);
+static void code_gen_line(void);
+static const parse_node_t *fold_tree(const parse_node_t *expression);
+static const parse_node_t *fold_variable(const parse_node_t *expression, var_binding_t *binding);
+static const parse_node_t *fold_operate(const parse_node_t *expression, const parse_node_t *lhs, const parse_node_t *rhs);
+static bool code_gen_tree(const parse_node_t *expression, ir_operand_t *result);
+static ir_operand_t code_variable(const parse_node_var_t *variable, var_binding_t *binding);
+static bool code_operate_swapped(const parse_node_operation_t *operation);
+static ir_operand_t code_operate(const parse_node_operation_t *operation, ir_operand_t lhs, ir_operand_t rhs);
+static void walk_frame_push(const parse_node_t *node);
+static void fold_result_push(const parse_node_t *node);
+static const parse_node_t *fold_result_pop(void);
+static void code_result_push(ir_operand_t operand);
+static ir_operand_t code_result_pop(void);
+static void walk_stack_reserve(void **items, size_t *cap, size_t len, size_t item_len);
+
+void code_gen_configure(const code_gen_options_t *options) {
+    code_gen_options = *options;
+}
+
+void code_gen_reset(void) {
+    memset(var_bindings, 0, var_bindings_len * sizeof(var_binding_t));
+    program_ir.len = 0;
+    program_ir.num_values = 0;
+    line_stores_len = 0;
+    last_line_result_valid = false;
+    jit_lanes_reset();
+}
+
+const char *code_gen(const parse_node_t *expression) {
+    // N.B. The whole line has been lexed by now, so this covers every identifier in it, and the bindings won't move
+    // while we hold pointers into them.
+    var_bindings_reserve(intern_count());
+    if(code_gen_options.format == X86_OUTPUT_JIT) {
+        // Those past JIT_MAX_VARIABLES get no slot (see var_binding_enter())
+        jit_reserve_variables(intern_count() < JIT_MAX_VARIABLES ? intern_count() : JIT_MAX_VARIABLES);
+        ++code_gen_unit;
+    }
+
+    if(code_gen_options.fold_constants) {
+        stats_phase_push(STATS_PHASE_FOLD);
+        expression = fold_tree(expression);
+        stats_phase_pop();
+        if(expression == NULL) {
+            return walk_error;
         }
     }
+
+    stats_phase_push(STATS_PHASE_LOWER);
+    bool ok = code_gen_tree(expression, &last_line_result);
+    last_line_result_valid = ok;
+    stats_phase_pop();
+    if(!ok) {
+        return walk_error;
+    }
+
+    if(code_gen_options.format == X86_OUTPUT_JIT) {
+        code_gen_line();
+    }
+    return NULL;
 }
 
-static questionable_return_t code_gen_rec(const parse_node_t *expression) {
-    assert(expression);
-
-    switch(expression->type) {
-        case NODE_TYPE_INT:
-            return (questionable_return_t){ .direct = expression->contents.integer.value };
-        case NODE_TYPE_VAR:
-            return (questionable_return_t) { .indirect = code_variable(&(expression->contents.variable)) };
-        case NODE_TYPE_OPERATION:
-            return (questionable_return_t) { .indirect = code_operate(&(expression->contents.operation)) };
-        default:
-            assert(false);
-            return (questionable_return_t) { .direct = -1};
+void code_gen_finish(void) {
+    if(code_gen_options.format == X86_OUTPUT_JIT) {
+        // Every line has already run (or is waiting; see code_gen_run_waiting()).
+        return;
+    }
+
+    if(last_line_result_valid) {
+        ir_emit_return(&program_ir, last_line_result);
+    }
+    if(code_gen_options.optimize_ir) {
+        stats_phase_push(STATS_PHASE_IR_PASSES);
+        ir_run_passes(&program_ir, code_gen_options.report_passes);
+        stats_phase_pop();
     }
+    x86_emit_options_t emit_options = {
+        .format = code_gen_options.format,
+        .peephole_window = code_gen_options.peephole_window,
+        .report = code_gen_options.report_passes,
+    };
+    x86_emit_program(&program_ir, &emit_options);
 }
 
-static symbol_table_index_t code_variable(const parse_node_var_t *variable) {
-    // TODO: All the assignment-checking, hashing, and compiler errors
-    if(!var_hashtab_has_been_initialized) {
-        hcreate_r(VAR_HASHTAB_LEN, &var_hashtab);
+// Stores what the line assigned, and runs it (or has it wait for the lines after it that are just like it).
+static void code_gen_line(void) {
+    for(size_t idx = 0; idx < line_stores_len; ++idx) {
+        const var_binding_t *binding = &var_bindings[line_stores[idx]];
+        ir_emit_store(&program_ir, line_stores[idx], ir_val(binding->version));
     }
-    // N.B. We're storing the symbol_table_index_t s as casted void * s
-    ENTRY *entry;
-    symbol_table_index_t st_idx;
+    line_stores_len = 0;
 
-    if(variable->declaration) {
-        if(hsearch_r((ENTRY) { .key = (char *) variable->identifier }, FIND, &entry, &var_hashtab)) { // Succeeds
-            // TODO: This should be a user-facing check (as it ensures this isn't a duplicate declaration)!
-            assert(false);
-        }
-        st_idx = symbol_add();
-        int res = hsearch_r((ENTRY) { .key = (char *) variable->identifier, .data = (symbol_table_index_t *) st_idx }, ENTER, &entry, &var_hashtab);
-        if(!res) { // Fails
-            // TODO: User-facing "out of symbols" error
-            assert(false);
-        }
+    ir_emit_return(&program_ir, last_line_result);
+    last_line_result_valid = false;
+    if(code_gen_options.optimize_ir) {
+        stats_phase_push(STATS_PHASE_IR_PASSES);
+        ir_run_passes(&program_ir, code_gen_options.report_passes);
+        stats_phase_pop();
     }
-    else  {
-        if(!hsearch_r((ENTRY) { .key = (char *) variable->identifier }, FIND, &entry, &var_hashtab)) { // Fails
-            // TODO: This should be a user-facing check (as it ensures we don't use nonexistant variables)!
-            assert(false);
-        }
-        st_idx = (symbol_table_index_t) entry->data;
+    x86_emit_options_t emit_options = {
+        .format = X86_OUTPUT_JIT,
+        .peephole_window = code_gen_options.peephole_window,
+        .report = code_gen_options.report_passes,
+        .interactive = code_gen_options.interactive,
+    };
+    // N.B. Someone waiting for each line has to get it right away.
+    if(code_gen_options.interactive || !jit_lanes_add(&program_ir, &emit_options)) {
+        jit_lanes_flush(&emit_options);
+        x86_emit_program(&program_ir, &emit_options);
     }
 
-    // Implied by declaration, but possible even without
-    if(variable->assignment) {
-        questionable_properties_t subprops = questionable_return_props(variable->subexpr->type);
-        if(subprops.indirect) {
-            const char *myregs[2];
-            symbol_table_index_t sub_idx = code_gen_rec(variable->subexpr).indirect;
-            symbol_give_me_my_stuff(2, myregs, st_idx, sub_idx);
-            printf("\tmovl %s, %s\n", myregs[1], myregs[0]);
-            if(subprops.cleanup) {
-                symbol_del(sub_idx);
-            }
-        } else { // direct
-            const char *myreg[1];
-            symbol_give_me_my_stuff(1, myreg, st_idx);
-            printf("\tmovl $%d, %s\n", code_gen_rec(variable->subexpr).direct, myreg[0]);
-        }
+    program_ir.len = 0;
+    program_ir.num_values = 0;
+}
+
+void code_gen_run_waiting(void) {
+    if(code_gen_options.format != X86_OUTPUT_JIT) {
+        return;
     }
+    x86_emit_options_t emit_options = {
+        .format = X86_OUTPUT_JIT,
+        .peephole_window = code_gen_options.peephole_window,
+        .report = code_gen_options.report_passes,
+        .interactive = code_gen_options.interactive,
+    };
+    jit_lanes_flush(&emit_options);
+}
 
-    // Make a copy so that we don't clobber the variable's value during calculations.
-    symbol_table_index_t tmp_idx = symbol_add();
-    const char *myregs[2];
-    symbol_give_me_my_stuff(2, myregs, st_idx, tmp_idx);
-    printf("\tmovl %s, %s\n", myregs[0], myregs[1]);
+static void var_bindings_reserve(size_t len) {
+    if(len <= var_bindings_len) {
+        return;
+    }
+    size_t new_len = var_bindings_len ? var_bindings_len : INIT_VAR_BINDINGS_LEN;
+    while(new_len < len) {
+        new_len *= VAR_BINDINGS_GROWTH_FACTOR;
+    }
+    var_binding_t *new_bindings = realloc(var_bindings, new_len * sizeof(var_binding_t));
+    // TODO: Compiler error if out of memory!
+    assert(new_bindings != NULL);
+    memset(new_bindings + var_bindings_len, 0, (new_len - var_bindings_len) * sizeof(var_binding_t));
+    var_bindings = new_bindings;
+    var_bindings_len = new_len;
+}
 
-    return tmp_idx;
+static var_binding_t *var_binding_find(intern_id_t identifier) {
+    if(identifier >= var_bindings_len || !var_bindings[identifier].declared) {
+        return NULL;
+    }
+    return &var_bindings[identifier];
 }
 
-static symbol_table_index_t code_operate(const parse_node_operation_t *operation) {
-    static int jump_target_num = 0;
-
-    switch(operation->operr) {
-        case OP_NOOP:
-            return -1;
-        case OP_ADD2:
-        case OP_SUB2:
-            assert(operation->num_ops == 2);
-            if (!questionable_return_props(operation->ops[0]->type).indirect &&
-                !questionable_return_props(operation->ops[1]->type).indirect) {
-                symbol_table_index_t sindex = symbol_add();
-                const char * symbol_text[1];
-                if( ! symbol_give_me_my_stuff(1, symbol_text, sindex) ) {
-                    // TODO: Don't die.
-                    assert(false);
-                }
-                printf("\tmovl $%d, %s\n", code_gen_rec(operation->ops[0]).direct, symbol_text[0]);
-                printf("\t%s $%d, %s\n", code_gen_op_to_mnem(operation->operr), code_gen_rec(operation->ops[1]).direct, symbol_text[0]);
+// N.B. NULL (with walk_error set) if the variable has already been declared
+static var_binding_t *var_binding_declare(intern_id_t identifier) {
+    if(var_binding_find(identifier) != NULL) {
+        walk_error = "Redeclared variable";
+        return NULL;
+    }
+    assert(identifier < var_bindings_len);
+    var_binding_t *binding = &var_bindings[identifier];
+    *binding = (var_binding_t) { .declared = true, .has_version = false };
+    return binding;
+}
 
-                return sindex;
-            }
-            else if (!questionable_return_props(operation->ops[0]->type).indirect) {
-                symbol_table_index_t dindex = code_gen_rec(operation->ops[1]).indirect;
-                symbol_table_index_t sindex = symbol_add();
-                const char * symbol_text[2];
-                if( ! symbol_give_me_my_stuff(2, symbol_text, sindex, dindex) ) {
-                    // TODO: Don't die.
-                    assert(false);
-                }
-                printf("\tmovl $%d, %s\n", code_gen_rec(operation->ops[0]).direct, symbol_text[0]);
-                printf("\t%s %s, %s\n", code_gen_op_to_mnem(operation->operr), symbol_text[1], symbol_text[0]);
-                if(questionable_return_props(operation->ops[1]->type).cleanup) {
-                    symbol_del(dindex);
-                }
+static bool var_binding_has_version(const var_binding_t *binding) {
+    return binding->has_version && binding->version_unit == code_gen_unit;
+}
 
-                return sindex;
-            }
-            else if (!questionable_return_props(operation->ops[1]->type).indirect) {
-                symbol_table_index_t dindex = code_gen_rec(operation->ops[0]).indirect;
-                const char * symbol_text[1];
-                if( ! symbol_give_me_my_stuff(1, symbol_text, dindex) ) {
-                    // TODO: Live, damn you!
-                    assert(false);
-                }
-                printf("\t%s $%d, %s\n", code_gen_op_to_mnem(operation->operr), code_gen_rec(operation->ops[1]).direct, symbol_text[0]);
+static void line_store_add(intern_id_t identifier, var_binding_t *binding) {
+    if(binding->stored_unit == code_gen_unit) {
+        return;
+    }
+    binding->stored_unit = code_gen_unit;
+    if(line_stores_len == line_stores_cap) {
+        size_t new_cap = line_stores_cap ? line_stores_cap * VAR_BINDINGS_GROWTH_FACTOR : INIT_VAR_BINDINGS_LEN;
+        intern_id_t *new_stores = realloc(line_stores, new_cap * sizeof(intern_id_t));
+        // TODO: Compiler error if out of memory!
+        assert(new_stores != NULL);
+        line_stores = new_stores;
+        line_stores_cap = new_cap;
+    }
+    line_stores[line_stores_len++] = identifier;
+}
 
-                return dindex;
-            }
-            else {
-                symbol_table_index_t dindex = code_gen_rec(operation->ops[0]).indirect;
-                symbol_table_index_t sindex = code_gen_rec(operation->ops[1]).indirect;
-                const char * symbol_text[2];
-                if( ! symbol_give_me_my_stuff(2, symbol_text, sindex, dindex) ) {
-                    // TODO: Die if you must
-                    assert(false);
+// Collapses every constant subtree into a NODE_TYPE_INT, substituting the values of variables that are known at this
+// point of the program. N.B. This visits the tree in the same order code_gen_tree() does, since assignments update the
+// bindings as they go. Returns NULL (with walk_error set) if the tree misuses a variable.
+static const parse_node_t *fold_tree(const parse_node_t *expression) {
+    walk_frame_push(expression);
+    while(walk_frames_len > 0) {
+        walk_frame_t *frame = &walk_frames[walk_frames_len - 1];
+        const parse_node_t *node = frame->node;
+
+        switch(node->type) {
+            case NODE_TYPE_INT:
+                --walk_frames_len;
+                fold_result_push(node);
+                break;
+            case NODE_TYPE_VAR:
+                if(frame->stage++ == 0) {
+                    frame->binding = var_binding_enter(&(node->contents.variable));
+                    if(frame->binding == NULL) {
+                        walk_frames_len = 0;
+                        fold_results_len = 0;
+                        return NULL;
+                    }
+                    if(node->contents.variable.assignment) {
+                        walk_frame_push(node->contents.variable.subexpr);
+                        break;
+                    }
                 }
-                printf("\t%s %s, %s\n", code_gen_op_to_mnem(operation->operr), symbol_text[0], symbol_text[1]);
-                if(questionable_return_props(operation->ops[1]->type).cleanup) {
-                    symbol_del(sindex);
+                --walk_frames_len;
+                fold_result_push(fold_variable(node, frame->binding));
+                break;
+            case NODE_TYPE_OPERATION: {
+                assert(node->contents.operation.num_ops == 2);
+                if(frame->stage < 2) {
+                    walk_frame_push(node->contents.operation.ops[frame->stage++]);
+                    break;
                 }
-
-                return dindex;
+                --walk_frames_len;
+                const parse_node_t *rhs = fold_result_pop();
+                fold_result_push(fold_operate(node, fold_result_pop(), rhs));
+                break;
             }
+            default:
+                assert(false);
+                break;
+        }
+    }
 
-            // TODO: remove after cases above are complete (they should all return).
-            return -1;
-        case OP_EQUL:
-        case OP_NEQL:
-        case OP_LESS:
-        case OP_GREA:
-            assert(operation->num_ops == 2);
-            bool swapped = false;
-            if(!questionable_return_props(operation->ops[0]->type).indirect && !questionable_return_props(operation->ops[1]->type).indirect) { // both direct
-                symbol_table_index_t dindex = symbol_add();
-                const char * ret_symbol_text[1];
-                if( ! symbol_give_me_my_stuff(1, ret_symbol_text, dindex) ) {
-                    // TODO: Die die die
-                    assert(false);
-                }
-                //XXX: Oops, always does equals, no others work.
-                switch(operation->operr) {
-                    case OP_EQUL:
-                        if(code_gen_rec(operation->ops[0]).direct == code_gen_rec(operation->ops[1]).direct) {
-                            printf("\tmovl $1, %s\n", ret_symbol_text[0]);
-                        }
-                        else {
-                            printf("\tmovl $0, %s\n", ret_symbol_text[0]);
-                        }
-                        break;
-                    case OP_NEQL:
-                        if(code_gen_rec(operation->ops[0]).direct != code_gen_rec(operation->ops[1]).direct) {
-                            printf("\tmovl $1, %s\n", ret_symbol_text[0]);
-                        }
-                        else {
-                            printf("\tmovl $0, %s\n", ret_symbol_text[0]);
-                        }
-                        break;
-                    case OP_GREA:
-                        if(code_gen_rec(operation->ops[0]).direct > code_gen_rec(operation->ops[1]).direct) {
-                            printf("\tmovl $1, %s\n", ret_symbol_text[0]);
-                        }
-                        else {
-                            printf("\tmovl $0, %s\n", ret_symbol_text[0]);
-                        }
-                        break;
-                    case OP_LESS:
-                        if(code_gen_rec(operation->ops[0]).direct < code_gen_rec(operation->ops[1]).direct) {
-                            printf("\tmovl $1, %s\n", ret_symbol_text[0]);
-                        }
-                        else {
-                            printf("\tmovl $0, %s\n", ret_symbol_text[0]);
-                        }
-                        break;
-                    default:
-                        assert(false); // Never ever
-                        break;
-                }
-                return dindex; //I want to return here fo sho, not so for the later cases
+    assert(fold_results_len == 1);
+    return fold_result_pop();
+}
+
+// N.B. subexpr has been folded by now (if there is one)
+static const parse_node_t *fold_variable(const parse_node_t *expression, var_binding_t *binding) {
+    const parse_node_var_t *variable = &(expression->contents.variable);
+    if(!variable->assignment) {
+        if(binding->value_known) {
+            return parse_node_int(binding->value);
+        }
+        return expression;
+    }
+
+    const parse_node_t *subexpr = fold_result_pop();
+    if(subexpr->type == NODE_TYPE_INT) {
+        binding->value_known = true;
+        binding->value = subexpr->contents.integer.value;
+        return subexpr;
+    }
+    binding->value_known = false;
+    // The declaration has been handled above, so all that is left for codegen is the assignment.
+    return parse_node_var(false, true, variable->identifier, subexpr);
+}
+
+static const parse_node_t *fold_operate(const parse_node_t *expression, const parse_node_t *lhs, const parse_node_t *rhs) {
+    const parse_node_operation_t *operation = &(expression->contents.operation);
+    parse_node_operator_t operr = operation->operr;
+
+    // N.B. A division that would trap is left for run time, so that it still does.
+    if(lhs->type == NODE_TYPE_INT && rhs->type == NODE_TYPE_INT &&
+       ir_can_evaluate(operr, lhs->contents.integer.value, rhs->contents.integer.value)) {
+        return parse_node_int(ir_evaluate(operr, lhs->contents.integer.value, rhs->contents.integer.value));
+    }
+
+    if(operr == OP_ADD2 || operr == OP_SUB2) {
+        // Canonicalize (c + x) to (x + c) so that constants collect on the right of the chain.
+        if(operr == OP_ADD2 && lhs->type == NODE_TYPE_INT) {
+            const parse_node_t *tmp = lhs;
+            lhs = rhs;
+            rhs = tmp;
+        }
+        // Reassociate ((x +/- c1) +/- c2) into (x + c) so that constants collapse across the chain.
+        if(rhs->type == NODE_TYPE_INT) {
+            unsigned total = (operr == OP_ADD2) ? (unsigned) rhs->contents.integer.value : -(unsigned) rhs->contents.integer.value;
+            if(lhs->type == NODE_TYPE_OPERATION &&
+               (lhs->contents.operation.operr == OP_ADD2 || lhs->contents.operation.operr == OP_SUB2) &&
+               lhs->contents.operation.ops[1]->type == NODE_TYPE_INT) {
+                unsigned inner = (unsigned) lhs->contents.operation.ops[1]->contents.integer.value;
+                total += (lhs->contents.operation.operr == OP_ADD2) ? inner : -inner;
+                lhs = lhs->contents.operation.ops[0];
             }
-            else if(questionable_return_props(operation->ops[0]->type).indirect && questionable_return_props(operation->ops[1]->type).indirect) { // both indirect
-                symbol_table_index_t lindex = code_gen_rec(operation->ops[0]).indirect;
-                symbol_table_index_t rindex = code_gen_rec(operation->ops[1]).indirect;
-                const char * symbol_text[2];
-                if( ! symbol_give_me_my_stuff(2, symbol_text, lindex, rindex) ) {
-                    // TODO: Die if you must
-                    assert(false);
-                }
-                printf("\tcmpl %s, %s\n", symbol_text[1], symbol_text[0]);
-                symbol_del(rindex);
-                symbol_del(lindex);
+            if(total == 0) {
+                return lhs;
             }
-            else { // one direct one indirect
-                int numba;
-                symbol_table_index_t sindex;
-                if(!questionable_return_props(operation->ops[0]->type).indirect) {
-                    numba = code_gen_rec(operation->ops[0]).direct;
-                    sindex = code_gen_rec(operation->ops[1]).indirect;
-                    swapped = true;
+            return parse_node_operation(OP_ADD2, 2, lhs, parse_node_int((int) total));
+        }
+    }
+
+    if(lhs == operation->ops[0] && rhs == operation->ops[1]) {
+        return expression;
+    }
+    return parse_node_operation(operr, 2, lhs, rhs);
+}
+
+// Returns false (with walk_error set) if the tree misuses a variable.
+static bool code_gen_tree(const parse_node_t *expression, ir_operand_t *result) {
+    walk_frame_push(expression);
+    while(walk_frames_len > 0) {
+        walk_frame_t *frame = &walk_frames[walk_frames_len - 1];
+        const parse_node_t *node = frame->node;
+
+        switch(node->type) {
+            case NODE_TYPE_INT:
+                --walk_frames_len;
+                code_result_push(ir_imm(node->contents.integer.value));
+                break;
+            case NODE_TYPE_VAR:
+                if(frame->stage++ == 0) {
+                    frame->binding = var_binding_enter(&(node->contents.variable));
+                    if(frame->binding == NULL) {
+                        walk_frames_len = 0;
+                        code_results_len = 0;
+                        return false;
+                    }
+                    if(node->contents.variable.assignment) {
+                        walk_frame_push(node->contents.variable.subexpr);
+                        break;
+                    }
                 }
-                else {
-                    numba = code_gen_rec(operation->ops[1]).direct;
-                    sindex = code_gen_rec(operation->ops[0]).indirect;
-                    swapped = false;
+                --walk_frames_len;
+                code_result_push(code_variable(&(node->contents.variable), frame->binding));
+                break;
+            case NODE_TYPE_OPERATION: {
+                if(frame->stage == 0) {
+                    frame->swapped = code_operate_swapped(&(node->contents.operation));
                 }
-                const char * symbol_text[1];
-                if( ! symbol_give_me_my_stuff(1, symbol_text, sindex) ) {
-                    // TODO: Die if you must
-                    assert(false);
+                if(frame->stage < 2) {
+                    size_t child = frame->swapped ? 1 - frame->stage : frame->stage;
+                    ++frame->stage;
+                    walk_frame_push(node->contents.operation.ops[child]);
+                    break;
                 }
-                printf("\tcmpl $%d, %s\n", numba, symbol_text[0]);
-                symbol_del(sindex);
+                --walk_frames_len;
+                bool swapped = frame->swapped;
+                ir_operand_t second = code_result_pop();
+                ir_operand_t first = code_result_pop();
+                code_result_push(code_operate(&(node->contents.operation), swapped ? second : first,
+                                              swapped ? first : second));
+                break;
             }
-            // Get here because it's in a second instruction
-            symbol_table_index_t dindex = symbol_add();
-            const char * ret_symbol_text[1];
-            if( ! symbol_give_me_my_stuff(1, ret_symbol_text, dindex) ) {
-                // TODO: Die die die
+            default:
                 assert(false);
-            }
-            // XXX: Hmm, greater and less than may use the wrong assembly operation?
-            const char *op_mnem;
-            if(!swapped || operation->operr == OP_EQUL || operation->operr == OP_NEQL) {
-                op_mnem = code_gen_op_to_mnem(operation->operr);
-            } else { // If swapped and less than or greater then
-                op_mnem = code_gen_op_to_mnem((operation->operr == OP_LESS) ? OP_GREA : OP_LESS);
-            }
-            printf("\t%s cmp_ll%d\n", op_mnem, jump_target_num);
-            printf("\tmovl $0, %s\n", ret_symbol_text[0]);
-            printf("\tjmp cmp_ll%d\n", jump_target_num+1);
-            printf("cmp_ll%d:\n", jump_target_num);
-            printf("\tmovl $1, %s\n", ret_symbol_text[0]);
-            printf("cmp_ll%d:\n", jump_target_num+1);
-            jump_target_num += 2;
-            return dindex;
-        default:
-            assert(false);
-            return -1;
+                break;
+        }
     }
+
+    assert(code_results_len == 1);
+    *result = code_result_pop();
+    return true;
+}
+
+// N.B. The subexpression's value is on top of the results stack by now (if there is one)
+static ir_operand_t code_variable(const parse_node_var_t *variable, var_binding_t *binding) {
+    // Implied by declaration, but possible even without
+    if(variable->assignment) {
+        ir_operand_t sub = code_result_pop();
+        if(!sub.is_value) {
+            // A variable always names a value
+            sub = ir_val(ir_emit_mov(&program_ir, sub));
+        }
+        binding->version = sub.u.value;
+        binding->version_unit = code_gen_unit;
+        binding->has_version = true;
+        if(code_gen_options.format == X86_OUTPUT_JIT) {
+            line_store_add(variable->identifier, binding);
+        }
+    }
+
+    if(!var_binding_has_version(binding)) {
+        if(code_gen_options.format == X86_OUTPUT_JIT) {
+            // Whatever an earlier line left in the slot (or zero, if nothing ever assigned the variable)
+            binding->version = ir_emit_load(&program_ir, variable->identifier);
+        }
+        else {
+            // Read before it was ever assigned (e.g. "int a = a"): it's garbage, so any value will do.
+            binding->version = ir_emit_mov(&program_ir, ir_imm(0));
+        }
+        binding->version_unit = code_gen_unit;
+        binding->has_version = true;
+    }
+
+    // N.B. No copy needed: the value can't change underneath us, since assigning to the variable makes a new one.
+    return ir_val(binding->version);
+}
+
+// Evaluate the side that needs more registers first, so the other side's result isn't held through all of it.
+// N.B. The IR keeps the operands in place whichever order they are computed in, so nothing needs to be swapped; but an
+// assignment on either side makes the order observable, and then it has to stay left to right.
+static bool code_operate_swapped(const parse_node_operation_t *operation) {
+    assert(operation->operr != OP_NOOP);
+    assert(operation->num_ops == 2);
+    const parse_node_t *left = operation->ops[0];
+    const parse_node_t *right = operation->ops[1];
+    return right->registers > left->registers && !left->assigns && !right->assigns;
+}
+
+static ir_operand_t code_operate(const parse_node_operation_t *operation, ir_operand_t lhs, ir_operand_t rhs) {
+    return ir_val(ir_emit_binary(&program_ir, operation->operr, lhs, rhs));
+}
+
+static void walk_frame_push(const parse_node_t *node) {
+    assert(node);
+    walk_stack_reserve((void **) &walk_frames, &walk_frames_cap, walk_frames_len + 1, sizeof(walk_frame_t));
+    walk_frames[walk_frames_len++] = (walk_frame_t) { .node = node, .stage = 0 };
+}
+
+static void fold_result_push(const parse_node_t *node) {
+    walk_stack_reserve((void **) &fold_results, &fold_results_cap, fold_results_len + 1, sizeof(*fold_results));
+    fold_results[fold_results_len++] = node;
+}
+
+static const parse_node_t *fold_result_pop(void) {
+    assert(fold_results_len > 0);
+    return fold_results[--fold_results_len];
+}
+
+static void code_result_push(ir_operand_t operand) {
+    walk_stack_reserve((void **) &code_results, &code_results_cap, code_results_len + 1, sizeof(*code_results));
+    code_results[code_results_len++] = operand;
+}
+
+static ir_operand_t code_result_pop(void) {
+    assert(code_results_len > 0);
+    return code_results[--code_results_len];
 }
 
-static const char * code_gen_op_to_mnem(parse_node_operator_t operr) {
-    switch(operr) {
-        case OP_ADD2:
-            return "addl";
-        case OP_SUB2:
-            return "subl";
-        case OP_EQUL:
-            return "je";
-        case OP_NEQL:
-            return "jne";
-        case OP_GREA:
-            return "jg";
-        case OP_LESS:
-            return "jl";
-        default:
-            assert(false);
-            return "faill";
+static void walk_stack_reserve(void **items, size_t *cap, size_t len, size_t item_len) {
+    if(len <= *cap) {
+        return;
     }
+    size_t new_cap = *cap ? *cap * WALK_STACK_GROWTH_FACTOR : INIT_WALK_STACK_LEN;
+    void *new_items = realloc(*items, new_cap * item_len);
+    // TODO: Compiler error if out of memory!
+    assert(new_items != NULL);
+    *items = new_items;
+    *cap = new_cap;
 }
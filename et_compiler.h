@@ -1,5 +1,36 @@
 #pragma once
 
 #include "parse_tree.h"
+#include "x86_emit.h"
 
-void code_gen(const parse_node_t *expression);
+#include <stdbool.h>
+
+typedef struct {
+    x86_output_format_t format;
+    // Fold constant subtrees and propagate known variable values across lines.
+    bool fold_constants;
+    // Run the IR optimization passes.
+    bool optimize_ir;
+    // How many instructions the peephole optimizer looks at at once (0 turns it off)
+    size_t peephole_window;
+    // Report what each IR pass and peephole rule did on stderr.
+    bool report_passes;
+    // Print each JIT result as soon as its line has run, rather than in large chunks.
+    bool interactive;
+} code_gen_options_t;
+
+void code_gen_configure(const code_gen_options_t *options);
+
+// Forgets the variables and code of the previous unit compiled on this thread. N.B. Interned IDs are reused by the next
+// unit, so call intern_reset() along with it.
+void code_gen_reset(void);
+// Returns NULL, or (if the line declares a variable twice or uses one that was never declared) what is wrong with it.
+const char *code_gen(const parse_node_t *expression);
+
+// Called once the whole input has been consumed: optimizes and emits the program, which leaves the last line's value in
+// %eax.
+void code_gen_finish(void);
+
+// The JIT may hold lines back to run several at once (see jit_lanes.h), so call this at the end of the input (or at an
+// error) to run and print them. Does nothing for other formats.
+void code_gen_run_waiting(void);
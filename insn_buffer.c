@@ -0,0 +1,217 @@
+#include "insn_buffer.h"
+#include "output.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define INIT_INSN_BUFFER_LEN ((size_t) 256)
+#define INSN_BUFFER_GROWTH_FACTOR ((size_t) 2)
+
+static const char *const register_names_32[X86_NUM_REGISTERS] = {
+    "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+    "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d",
+};
+
+static const char *const register_names_8[X86_NUM_REGISTERS] = {
+    "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+    "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b",
+};
+
+static const char *const register_names_64[X86_NUM_REGISTERS] = {
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+    "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+};
+
+static const char *insn_mnemonic(const insn_t *insn);
+static const char *const *insn_operand_names(const insn_t *insn, bool is_src);
+static void insn_print_operand(const insn_operand_t *operand, const char *const *register_names);
+static void insn_print_address(const insn_t *insn);
+
+insn_operand_t insn_imm(int32_t value) {
+    return (insn_operand_t) { .kind = OPND_IMM, .u.imm = value };
+}
+
+insn_operand_t insn_vreg(vreg_t vreg) {
+    return (insn_operand_t) { .kind = OPND_VREG, .u.vreg = vreg };
+}
+
+insn_operand_t insn_reg(x86_register_t reg) {
+    return (insn_operand_t) { .kind = OPND_REG, .u.reg = reg };
+}
+
+insn_operand_t insn_mem(int32_t rbp_offset) {
+    return (insn_operand_t) { .kind = OPND_MEM, .u.mem_offset = rbp_offset };
+}
+
+insn_operand_t insn_none(void) {
+    return (insn_operand_t) { .kind = OPND_NONE };
+}
+
+void insn_append(insn_buffer_t *buffer, insn_t insn) {
+    if(buffer->len == buffer->cap) {
+        buffer->cap = (buffer->cap == 0) ? INIT_INSN_BUFFER_LEN : buffer->cap * INSN_BUFFER_GROWTH_FACTOR;
+        buffer->insns = realloc(buffer->insns, buffer->cap * sizeof(*buffer->insns));
+        // TODO: Compiler error if out of memory
+        assert(buffer->insns != NULL);
+    }
+    buffer->insns[buffer->len++] = insn;
+}
+
+void insn_buffer_clear(insn_buffer_t *buffer) {
+    buffer->len = 0;
+}
+
+bool insn_writes_dst(const insn_t *insn) {
+    return insn->opcode != INSN_CMPL && insn->dst.kind != OPND_NONE;
+}
+
+void insn_buffer_print(const insn_buffer_t *buffer) {
+    for(size_t idx = 0; idx < buffer->len; ++idx) {
+        const insn_t *insn = &buffer->insns[idx];
+        if(insn->opcode == INSN_NOP) {
+            continue;
+        }
+        if(insn->opcode == INSN_CALL) {
+            output_str("\tcall putint\n");
+            continue;
+        }
+        output_char('\t');
+        output_str(insn_mnemonic(insn));
+        if(insn->opcode == INSN_LEAL) {
+            insn_print_address(insn);
+            continue;
+        }
+        const char *separator = " ";
+        if(insn->src.kind != OPND_NONE) {
+            output_str(separator);
+            insn_print_operand(&insn->src, insn_operand_names(insn, true));
+            separator = ", ";
+        }
+        if(insn->dst.kind != OPND_NONE) {
+            output_str(separator);
+            insn_print_operand(&insn->dst, insn_operand_names(insn, false));
+        }
+        output_char('\n');
+    }
+}
+
+static const char *insn_mnemonic(const insn_t *insn) {
+    switch(insn->opcode) {
+        case INSN_MOVL:
+            return "movl";
+        case INSN_ADDL:
+            return "addl";
+        case INSN_SUBL:
+            return "subl";
+        case INSN_XORL:
+            return "xorl";
+        case INSN_CMPL:
+            return "cmpl";
+        case INSN_LEAL:
+            return "leal";
+        case INSN_INCL:
+            return "incl";
+        case INSN_DECL:
+            return "decl";
+        case INSN_NEGL:
+            return "negl";
+        case INSN_IMULL:
+        case INSN_IMULL_WIDE:
+            return "imull";
+        case INSN_SALL:
+            return "sall";
+        case INSN_SARL:
+            return "sarl";
+        case INSN_SHRL:
+            return "shrl";
+        case INSN_CLTD:
+            return "cltd";
+        case INSN_IDIVL:
+            return "idivl";
+        case INSN_SETCC:
+            switch(insn->cond) {
+                case COND_E:
+                    return "sete";
+                case COND_NE:
+                    return "setne";
+                case COND_G:
+                    return "setg";
+                case COND_L:
+                    return "setl";
+            }
+            assert(false);
+            return "setfail";
+        case INSN_MOVZBL:
+            return "movzbl";
+        case INSN_CALL:
+            return "call";
+        case INSN_PUSHQ:
+            return "pushq";
+        case INSN_POPQ:
+            return "popq";
+        case INSN_MOVQ:
+            return "movq";
+        case INSN_SUBQ:
+            return "subq";
+        case INSN_LEAQ:
+            return "leaq";
+        case INSN_LEAVE:
+            return "leave";
+        default:
+            assert(false);
+            return "faill";
+    }
+}
+
+// Which size of register the operand refers to
+static const char *const *insn_operand_names(const insn_t *insn, bool is_src) {
+    if(insn->opcode >= INSN_PUSHQ) {
+        return register_names_64;
+    }
+    bool is_shift = insn->opcode == INSN_SALL || insn->opcode == INSN_SARL || insn->opcode == INSN_SHRL;
+    if(insn->opcode == INSN_SETCC || ((insn->opcode == INSN_MOVZBL || is_shift) && is_src)) {
+        return register_names_8;
+    }
+    return register_names_32;
+}
+
+static void insn_print_operand(const insn_operand_t *operand, const char *const *register_names) {
+    switch(operand->kind) {
+        case OPND_IMM:
+            output_char('$');
+            output_int(operand->u.imm);
+            break;
+        case OPND_REG:
+            output_str(register_names[operand->u.reg]);
+            break;
+        case OPND_MEM:
+            output_int(operand->u.mem_offset);
+            output_str("(%rbp)");
+            break;
+        default:
+            // Virtual registers and missing operands have no business here
+            assert(false);
+            break;
+    }
+}
+
+// leal disp(%base,%index,scale), %dst. N.B. The address is computed with the full registers; only its low half is kept.
+static void insn_print_address(const insn_t *insn) {
+    output_char(' ');
+    if(insn->disp != 0) {
+        output_int(insn->disp);
+    }
+    output_char('(');
+    insn_print_operand(&insn->src, register_names_64);
+    if(insn->index.kind != OPND_NONE) {
+        output_char(',');
+        insn_print_operand(&insn->index, register_names_64);
+        if(insn->index_shift != 0) {
+            output_char(',');
+            output_int(1 << insn->index_shift);
+        }
+    }
+    output_str("), ");
+    insn_print_operand(&insn->dst, register_names_32);
+    output_char('\n');
+}
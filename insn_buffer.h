@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Numbered as in the x86-64 ModRM/REX encoding.
+typedef enum {
+    X86_RAX = 0,
+    X86_RCX,
+    X86_RDX,
+    X86_RBX,
+    X86_RSP,
+    X86_RBP,
+    X86_RSI,
+    X86_RDI,
+    X86_R8,
+    X86_R9,
+    X86_R10,
+    X86_R11,
+    X86_R12,
+    X86_R13,
+    X86_R14,
+    X86_R15,
+} x86_register_t;
+
+#define X86_NUM_REGISTERS ((size_t) 16)
+
+typedef enum {
+    COND_E,
+    COND_NE,
+    COND_G,
+    COND_L,
+} insn_cond_t;
+
+typedef enum {
+    // Deleted; never printed
+    INSN_NOP,
+    INSN_MOVL,
+    INSN_ADDL,
+    INSN_SUBL,
+    INSN_XORL,
+    INSN_CMPL,
+    // Writes src + index + disp, without touching the flags
+    INSN_LEAL,
+    // Read-modify-write their destination, and have no source
+    INSN_INCL,
+    INSN_DECL,
+    INSN_NEGL,
+    // dst *= src, where dst is a register
+    INSN_IMULL,
+    // Shift their destination by src, which is an immediate or %cl
+    INSN_SALL,
+    INSN_SARL,
+    INSN_SHRL,
+    // No dst, as it's implicit: edx = the sign of eax; edx:eax = eax * src; eax = edx:eax / src and edx = the remainder
+    INSN_CLTD,
+    INSN_IMULL_WIDE,
+    INSN_IDIVL,
+    // Writes the byte form of its destination
+    INSN_SETCC,
+    // Reads the byte form of its source
+    INSN_MOVZBL,
+    INSN_CALL,
+    // Only used for the stack frame
+    INSN_PUSHQ,
+    INSN_POPQ,
+    INSN_MOVQ,
+    INSN_SUBQ,
+    INSN_LEAQ,
+    INSN_LEAVE,
+} insn_opcode_t;
+
+typedef enum {
+    OPND_NONE = 0,
+    OPND_IMM,
+    // A virtual register, i.e. a symbol that hasn't been given a location yet
+    OPND_VREG,
+    OPND_REG,
+    // %rbp-relative stack memory
+    OPND_MEM,
+} insn_operand_kind_t;
+
+typedef uint32_t vreg_t;
+
+typedef struct {
+    insn_operand_kind_t kind;
+    union {
+        int32_t imm;
+        vreg_t vreg;
+        x86_register_t reg;
+        int32_t mem_offset;
+    } u;
+} insn_operand_t;
+
+// N.B. Operands are in AT&T order: the destination (if any) comes last. `cond` is only meaningful for INSN_SETCC, and
+// `index`, `index_shift` and `disp` for INSN_LEAL, whose src is the base register of the address (index may be
+// OPND_NONE, and is scaled by 1 << index_shift).
+typedef struct {
+    insn_opcode_t opcode;
+    insn_cond_t cond;
+    insn_operand_t src;
+    insn_operand_t dst;
+    insn_operand_t index;
+    uint8_t index_shift;
+    int32_t disp;
+} insn_t;
+
+typedef struct {
+    insn_t *insns;
+    size_t len;
+    size_t cap;
+} insn_buffer_t;
+
+#define INSN_BUFFER_INIT { .insns = NULL, .len = 0, .cap = 0 }
+
+insn_operand_t insn_imm(int32_t value);
+insn_operand_t insn_vreg(vreg_t vreg);
+insn_operand_t insn_reg(x86_register_t reg);
+insn_operand_t insn_mem(int32_t rbp_offset);
+insn_operand_t insn_none(void);
+
+void insn_append(insn_buffer_t *buffer, insn_t insn);
+void insn_buffer_clear(insn_buffer_t *buffer);
+
+// Whether the instruction writes its destination operand (as opposed to only reading it, e.g. cmpl).
+bool insn_writes_dst(const insn_t *insn);
+
+// Writes the program as AT&T assembly through output.h.
+// N.B. All virtual registers must have been replaced by real locations.
+void insn_buffer_print(const insn_buffer_t *buffer);
@@ -0,0 +1,143 @@
+#include "arena.h"
+#include "intern.h"
+#include "thread_local.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INIT_INTERN_TABLE_LEN ((size_t) 64)
+#define INIT_INTERN_NAMES_LEN ((size_t) 64)
+#define INTERN_GROWTH_FACTOR ((size_t) 2)
+
+// The hash table only holds IDs (and their hashes, so that probing rarely has to look at the spelling); the spellings
+// themselves live in the names array, indexed by ID.
+// N.B. An empty slot has id == INTERN_NO_ID
+typedef struct {
+    uint32_t hash;
+    intern_id_t id;
+} intern_slot_t;
+
+typedef struct {
+    const char *text;
+    size_t len;
+} intern_name_t;
+
+// Open addressing with linear probing. The length is always a power of two, and the table is kept at most half full.
+static ET_THREAD_LOCAL intern_slot_t *intern_table = NULL;
+static ET_THREAD_LOCAL size_t intern_table_len = 0;
+
+static ET_THREAD_LOCAL intern_name_t *intern_names = NULL;
+static ET_THREAD_LOCAL size_t intern_names_len = 0;
+static ET_THREAD_LOCAL size_t intern_names_cap = 0;
+
+static ET_THREAD_LOCAL arena_t intern_arena = ARENA_INIT;
+
+static uint32_t intern_hash(const char *text, size_t len);
+static bool intern_table_grow(void);
+static intern_slot_t *intern_table_probe(intern_slot_t *table, size_t table_len, uint32_t hash, const char *text,
+                                         size_t len);
+
+intern_id_t intern(const char *text, size_t len) {
+    if(intern_names_len >= intern_table_len / 2 && !intern_table_grow()) {
+        return INTERN_NO_ID;
+    }
+
+    uint32_t hash = intern_hash(text, len);
+    intern_slot_t *slot = intern_table_probe(intern_table, intern_table_len, hash, text, len);
+    if(slot->id != INTERN_NO_ID) {
+        return slot->id;
+    }
+
+    if(intern_names_len == intern_names_cap) {
+        size_t new_cap = intern_names_cap ? intern_names_cap * INTERN_GROWTH_FACTOR : INIT_INTERN_NAMES_LEN;
+        intern_name_t *new_names = realloc(intern_names, new_cap * sizeof(intern_name_t));
+        if(new_names == NULL) {
+            return INTERN_NO_ID;
+        }
+        intern_names = new_names;
+        intern_names_cap = new_cap;
+    }
+    const char *copy = arena_strndup(&intern_arena, text, len);
+    if(copy == NULL) {
+        return INTERN_NO_ID;
+    }
+
+    intern_id_t id = (intern_id_t) intern_names_len++;
+    intern_names[id] = (intern_name_t) { .text = copy, .len = len };
+    *slot = (intern_slot_t) { .hash = hash, .id = id };
+    return id;
+}
+
+const char *intern_name(intern_id_t id) {
+    assert(id < intern_names_len);
+    return intern_names[id].text;
+}
+
+size_t intern_count(void) {
+    return intern_names_len;
+}
+
+void intern_reset(void) {
+    for(size_t idx = 0; idx < intern_table_len; ++idx) {
+        intern_table[idx].id = INTERN_NO_ID;
+    }
+    intern_names_len = 0;
+    arena_reset(&intern_arena);
+}
+
+// FNV-1a
+static uint32_t intern_hash(const char *text, size_t len) {
+    uint32_t hash = 2166136261u;
+    for(size_t idx = 0; idx < len; ++idx) {
+        hash ^= (unsigned char) text[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool intern_table_grow(void) {
+    size_t new_len = intern_table_len ? intern_table_len * INTERN_GROWTH_FACTOR : INIT_INTERN_TABLE_LEN;
+    intern_slot_t *new_table = malloc(new_len * sizeof(intern_slot_t));
+    if(new_table == NULL) {
+        return false;
+    }
+    for(size_t idx = 0; idx < new_len; ++idx) {
+        new_table[idx].id = INTERN_NO_ID;
+    }
+    for(size_t idx = 0; idx < intern_table_len; ++idx) {
+        const intern_slot_t *old = &intern_table[idx];
+        if(old->id != INTERN_NO_ID) {
+            // N.B. Every ID is distinct, so this only ever stops at an empty slot without comparing spellings.
+            size_t pos = old->hash & (new_len - 1);
+            while(new_table[pos].id != INTERN_NO_ID) {
+                pos = (pos + 1) & (new_len - 1);
+            }
+            new_table[pos] = *old;
+        }
+    }
+    free(intern_table);
+    intern_table = new_table;
+    intern_table_len = new_len;
+    return true;
+}
+
+// The slot holding this spelling, or else the empty slot where it belongs
+static intern_slot_t *intern_table_probe(intern_slot_t *table, size_t table_len, uint32_t hash, const char *text,
+                                         size_t len) {
+    size_t pos = hash & (table_len - 1);
+    for(;;) {
+        intern_slot_t *slot = &table[pos];
+        if(slot->id == INTERN_NO_ID) {
+            return slot;
+        }
+        if(slot->hash == hash) {
+            const intern_name_t *name = &intern_names[slot->id];
+            if(name->len == len && memcmp(name->text, text, len) == 0) {
+                return slot;
+            }
+        }
+        pos = (pos + 1) & (table_len - 1);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifiers are interned as soon as the lexer sees them: every distinct spelling gets a dense ID (0, 1, 2, ... in
+// order of first appearance), so everything after the lexer compares and indexes by ID instead of by string.
+typedef uint32_t intern_id_t;
+
+#define INTERN_NO_ID ((intern_id_t) UINT32_MAX)
+
+// N.B. Returns INTERN_NO_ID when out of memory
+intern_id_t intern(const char *text, size_t len);
+
+// The spelling of an ID handed out by intern(). Valid for the rest of the program.
+const char *intern_name(intern_id_t id);
+
+// How many distinct identifiers have been interned so far (i.e. one past the largest ID)
+size_t intern_count(void);
+
+// Forgets every identifier, so that the next unit's IDs start from 0 again.
+void intern_reset(void);
@@ -0,0 +1,129 @@
+#include "ir.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#define INIT_IR_PROGRAM_LEN ((size_t) 256)
+#define IR_PROGRAM_GROWTH_FACTOR ((size_t) 2)
+
+static void ir_append(ir_program_t *program, ir_insn_t insn);
+
+ir_operand_t ir_imm(int imm) {
+    return (ir_operand_t) { .is_value = false, .u.imm = imm };
+}
+
+ir_operand_t ir_val(ir_value_t value) {
+    return (ir_operand_t) { .is_value = true, .u.value = value };
+}
+
+ir_value_t ir_emit_mov(ir_program_t *program, ir_operand_t a) {
+    ir_value_t dst = program->num_values++;
+    ir_append(program, (ir_insn_t) { .opcode = IR_MOV, .dst = dst, .a = a });
+    return dst;
+}
+
+ir_value_t ir_emit_binary(ir_program_t *program, parse_node_operator_t operr, ir_operand_t a, ir_operand_t b) {
+    ir_value_t dst = program->num_values++;
+    ir_append(program, (ir_insn_t) { .opcode = IR_BINARY, .operr = operr, .dst = dst, .a = a, .b = b });
+    return dst;
+}
+
+void ir_emit_return(ir_program_t *program, ir_operand_t a) {
+    ir_append(program, (ir_insn_t) { .opcode = IR_RETURN, .dst = IR_NO_VALUE, .a = a });
+}
+
+ir_value_t ir_emit_load(ir_program_t *program, uint32_t slot) {
+    ir_value_t dst = program->num_values++;
+    ir_append(program, (ir_insn_t) { .opcode = IR_LOAD, .dst = dst, .a = ir_imm(0), .slot = slot });
+    return dst;
+}
+
+void ir_emit_store(ir_program_t *program, uint32_t slot, ir_operand_t a) {
+    ir_append(program, (ir_insn_t) { .opcode = IR_STORE, .dst = IR_NO_VALUE, .a = a, .slot = slot });
+}
+
+bool ir_defines_value(const ir_insn_t *insn) {
+    return insn->opcode == IR_MOV || insn->opcode == IR_BINARY || insn->opcode == IR_LOAD;
+}
+
+size_t ir_count_insns(const ir_program_t *program) {
+    size_t count = 0;
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        if(program->insns[idx].opcode != IR_NOP) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void ir_compact(ir_program_t *program) {
+    size_t kept = 0;
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        if(program->insns[idx].opcode != IR_NOP) {
+            program->insns[kept++] = program->insns[idx];
+        }
+    }
+    program->len = kept;
+}
+
+int ir_evaluate(parse_node_operator_t operr, int lhs, int rhs) {
+    switch(operr) {
+        case OP_ADD2:
+            return (int) ((unsigned) lhs + (unsigned) rhs);
+        case OP_SUB2:
+            return (int) ((unsigned) lhs - (unsigned) rhs);
+        case OP_EQUL:
+            return lhs == rhs;
+        case OP_NEQL:
+            return lhs != rhs;
+        case OP_GREA:
+            return lhs > rhs;
+        case OP_LESS:
+            return lhs < rhs;
+        case OP_MUL2:
+            return (int) ((unsigned) lhs * (unsigned) rhs);
+        case OP_DIV2:
+            assert(ir_can_evaluate(operr, lhs, rhs));
+            return lhs / rhs;
+        case OP_MOD2:
+            assert(ir_can_evaluate(operr, lhs, rhs));
+            return lhs % rhs;
+        case OP_SHL2:
+            return (int) ((unsigned) lhs << (rhs & 31));
+        case OP_SHR2:
+            // N.B. Spelled out because >> on a negative int is implementation-defined
+            return (lhs < 0) ? ~(~lhs >> (rhs & 31)) : lhs >> (rhs & 31);
+        case OP_SHRU2:
+            return (int) ((unsigned) lhs >> (rhs & 31));
+        case OP_MULH2:
+            return (int) ((uint64_t) ((int64_t) lhs * rhs) >> 32);
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+bool ir_can_evaluate(parse_node_operator_t operr, int lhs, int rhs) {
+    if(operr != OP_DIV2 && operr != OP_MOD2) {
+        return true;
+    }
+    return rhs != 0 && !(lhs == INT_MIN && rhs == -1);
+}
+
+bool ir_may_trap(const ir_insn_t *insn) {
+    if(insn->opcode != IR_BINARY || (insn->operr != OP_DIV2 && insn->operr != OP_MOD2)) {
+        return false;
+    }
+    return insn->b.is_value || insn->b.u.imm == 0 || insn->b.u.imm == -1;
+}
+
+static void ir_append(ir_program_t *program, ir_insn_t insn) {
+    if(program->len == program->cap) {
+        program->cap = (program->cap == 0) ? INIT_IR_PROGRAM_LEN : program->cap * IR_PROGRAM_GROWTH_FACTOR;
+        program->insns = realloc(program->insns, program->cap * sizeof(*program->insns));
+        // TODO: Compiler error if out of memory
+        assert(program->insns != NULL);
+    }
+    program->insns[program->len++] = insn;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "parse_tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t ir_value_t;
+
+#define IR_NO_VALUE ((ir_value_t) -1)
+
+// Either a literal or the result of an earlier instruction.
+typedef struct {
+    bool is_value;
+    union {
+        int imm;
+        ir_value_t value;
+    } u;
+} ir_operand_t;
+
+typedef enum {
+    // Left behind by passes that delete instructions
+    IR_NOP = 0,
+    // dst = a
+    IR_MOV,
+    // dst = a operr b
+    IR_BINARY,
+    // The program's result is a
+    IR_RETURN,
+    // dst = variable slot `slot` (only used by the JIT, where variables outlive the line that assigned them)
+    IR_LOAD,
+    // variable slot `slot` = a
+    IR_STORE,
+} ir_opcode_t;
+
+typedef struct {
+    ir_opcode_t opcode;
+    parse_node_operator_t operr;
+    ir_value_t dst;
+    ir_operand_t a;
+    ir_operand_t b;
+    uint32_t slot;
+} ir_insn_t;
+
+// The whole program as straight-line SSA: every instruction that produces something defines a brand new value, and
+// a variable is just a name for whichever value it was last assigned.
+typedef struct {
+    ir_insn_t *insns;
+    size_t len;
+    size_t cap;
+    ir_value_t num_values;
+} ir_program_t;
+
+#define IR_PROGRAM_INIT { .insns = NULL, .len = 0, .cap = 0, .num_values = 0 }
+
+ir_operand_t ir_imm(int imm);
+ir_operand_t ir_val(ir_value_t value);
+
+ir_value_t ir_emit_mov(ir_program_t *program, ir_operand_t a);
+ir_value_t ir_emit_binary(ir_program_t *program, parse_node_operator_t operr, ir_operand_t a, ir_operand_t b);
+void ir_emit_return(ir_program_t *program, ir_operand_t a);
+ir_value_t ir_emit_load(ir_program_t *program, uint32_t slot);
+void ir_emit_store(ir_program_t *program, uint32_t slot, ir_operand_t a);
+
+bool ir_defines_value(const ir_insn_t *insn);
+
+// Number of instructions, not counting IR_NOPs
+size_t ir_count_insns(const ir_program_t *program);
+
+// Squeezes out IR_NOPs
+void ir_compact(ir_program_t *program);
+
+// What operr computes on two known values. N.B. Arithmetic wraps around and shift counts are taken mod 32, just like
+// the machine instructions.
+int ir_evaluate(parse_node_operator_t operr, int lhs, int rhs);
+
+// Whether ir_evaluate() has an answer: dividing by zero (or INT_MIN by -1) traps, and that's left for run time
+bool ir_can_evaluate(parse_node_operator_t operr, int lhs, int rhs);
+
+// Whether the instruction might trap when it runs, so it has to stay even if nothing uses its result
+bool ir_may_trap(const ir_insn_t *insn);
@@ -0,0 +1,552 @@
+#include "ir_pass.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A binary instruction with its operands in canonical order, so that (a + b) and (b + a), or (a < b) and (b > a),
+// look the same.
+typedef struct {
+    parse_node_operator_t operr;
+    ir_operand_t a;
+    ir_operand_t b;
+} ir_cse_key_t;
+
+typedef struct {
+    ir_cse_key_t key;
+    ir_value_t value;
+} ir_cse_entry_t;
+
+typedef struct {
+    const char *name;
+    void (*run)(ir_program_t *program);
+} ir_pass_t;
+
+static void ir_pass_fold(ir_program_t *program);
+static bool ir_fold_binary(const ir_insn_t *insn, ir_operand_t *out);
+static void ir_pass_cse(ir_program_t *program);
+static void ir_pass_strength(ir_program_t *program);
+static ir_operand_t ir_reduce_binary(ir_program_t *out, const ir_insn_t *insn);
+static bool ir_reduce_multiply(ir_program_t *out, ir_operand_t x, uint32_t factor, ir_operand_t *result);
+static ir_operand_t ir_reduce_divide(ir_program_t *out, ir_operand_t x, int32_t divisor);
+static void ir_magic_divisor(uint32_t divisor, int32_t *multiplier, uint32_t *shift);
+static ir_operand_t ir_reduce_emit(ir_program_t *out, parse_node_operator_t operr, ir_operand_t a, ir_operand_t b);
+static uint32_t ir_log2(uint32_t power);
+static bool ir_is_power_of_two(uint32_t value);
+static void ir_pass_dce(ir_program_t *program);
+static ir_cse_key_t ir_cse_key(const ir_insn_t *insn);
+static int ir_operand_order(ir_operand_t lhs, ir_operand_t rhs);
+static uint32_t ir_cse_hash(const ir_cse_key_t *key);
+static bool ir_cse_key_equal(const ir_cse_key_t *lhs, const ir_cse_key_t *rhs);
+
+static const ir_pass_t ir_passes[] = {
+    { .name = "fold", .run = ir_pass_fold },
+    { .name = "cse", .run = ir_pass_cse },
+    // Once equal values have the same number, a - a and friends can be folded as well.
+    { .name = "fold", .run = ir_pass_fold },
+    // After folding, so it sees every constant operand there is to see
+    { .name = "strength", .run = ir_pass_strength },
+    // x / c and x % c come out as the same reciprocal sequence, which only needs computing once.
+    { .name = "cse", .run = ir_pass_cse },
+    // Last, as everything before it leaves dead instructions behind
+    { .name = "dce", .run = ir_pass_dce },
+};
+static const size_t IR_PASSES_LEN = sizeof ir_passes / sizeof(*ir_passes);
+
+void ir_run_passes(ir_program_t *program, bool report) {
+    for(size_t idx = 0; idx < IR_PASSES_LEN; ++idx) {
+        size_t before = ir_count_insns(program);
+        ir_passes[idx].run(program);
+        ir_compact(program);
+        if(report) {
+            fprintf(stderr, "%-8s %zu -> %zu IR instructions\n", ir_passes[idx].name, before, ir_count_insns(program));
+        }
+    }
+}
+
+// Constant folding, algebraic simplification and copy propagation in one forward sweep. Since this is straight-line
+// SSA, every use of a value comes after its definition, so once an instruction is found to just produce some existing
+// operand it can be deleted and its later uses replaced.
+static void ir_pass_fold(ir_program_t *program) {
+    ir_operand_t *replacement = malloc(program->num_values * sizeof(ir_operand_t));
+    bool *replaced = calloc(program->num_values, sizeof(bool));
+    // TODO: Compiler error if out of memory
+    assert(program->num_values == 0 || (replacement != NULL && replaced != NULL));
+
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        ir_insn_t *insn = &program->insns[idx];
+        if(insn->a.is_value && replaced[insn->a.u.value]) {
+            insn->a = replacement[insn->a.u.value];
+        }
+        if(insn->opcode == IR_BINARY && insn->b.is_value && replaced[insn->b.u.value]) {
+            insn->b = replacement[insn->b.u.value];
+        }
+
+        ir_operand_t result;
+        bool folded = false;
+        switch(insn->opcode) {
+            case IR_MOV:
+                result = insn->a;
+                folded = true;
+                break;
+            case IR_BINARY:
+                folded = ir_fold_binary(insn, &result);
+                break;
+            default:
+                break;
+        }
+        if(folded) {
+            replacement[insn->dst] = result;
+            replaced[insn->dst] = true;
+            insn->opcode = IR_NOP;
+        }
+    }
+
+    free(replaced);
+    free(replacement);
+}
+
+// N.B. Returns false if the instruction has to stay
+static bool ir_fold_binary(const ir_insn_t *insn, ir_operand_t *out) {
+    const ir_operand_t *a = &insn->a;
+    const ir_operand_t *b = &insn->b;
+
+    if(!a->is_value && !b->is_value) {
+        if(!ir_can_evaluate(insn->operr, a->u.imm, b->u.imm)) {
+            return false;
+        }
+        *out = ir_imm(ir_evaluate(insn->operr, a->u.imm, b->u.imm));
+        return true;
+    }
+
+    bool same_value = a->is_value && b->is_value && a->u.value == b->u.value;
+    switch(insn->operr) {
+        case OP_ADD2:
+            if(!b->is_value && b->u.imm == 0) {
+                *out = *a;
+                return true;
+            }
+            if(!a->is_value && a->u.imm == 0) {
+                *out = *b;
+                return true;
+            }
+            return false;
+        case OP_SUB2:
+            if(!b->is_value && b->u.imm == 0) {
+                *out = *a;
+                return true;
+            }
+            if(same_value) {
+                *out = ir_imm(0);
+                return true;
+            }
+            return false;
+        case OP_EQUL:
+            if(same_value) {
+                *out = ir_imm(1);
+                return true;
+            }
+            return false;
+        case OP_NEQL:
+        case OP_GREA:
+        case OP_LESS:
+            if(same_value) {
+                *out = ir_imm(0);
+                return true;
+            }
+            return false;
+        case OP_MUL2:
+            if((!a->is_value && a->u.imm == 0) || (!b->is_value && b->u.imm == 0)) {
+                *out = ir_imm(0);
+                return true;
+            }
+            if(!b->is_value && b->u.imm == 1) {
+                *out = *a;
+                return true;
+            }
+            if(!a->is_value && a->u.imm == 1) {
+                *out = *b;
+                return true;
+            }
+            return false;
+        case OP_DIV2:
+            if(!b->is_value && b->u.imm == 1) {
+                *out = *a;
+                return true;
+            }
+            return false;
+        case OP_MOD2:
+            if(!b->is_value && b->u.imm == 1) {
+                *out = ir_imm(0);
+                return true;
+            }
+            return false;
+        case OP_SHL2:
+        case OP_SHR2:
+        case OP_SHRU2:
+            if(!b->is_value && (b->u.imm & 31) == 0) {
+                *out = *a;
+                return true;
+            }
+            if(!a->is_value && a->u.imm == 0) {
+                *out = ir_imm(0);
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+// Global value numbering: the first instruction to compute some operation on some operands gives the answer to every
+// later one. Since this is SSA, a variable that gets reassigned names a new value, so its old entries simply stop
+// matching; nothing ever has to be invalidated.
+static void ir_pass_cse(ir_program_t *program) {
+    size_t table_len = 16;
+    while(table_len < program->len * 2) {
+        table_len *= 2;
+    }
+    ir_cse_entry_t *table = malloc(table_len * sizeof(ir_cse_entry_t));
+    ir_value_t *replacement = malloc(program->num_values * sizeof(ir_value_t));
+    // TODO: Compiler error if out of memory
+    assert(table != NULL && (program->num_values == 0 || replacement != NULL));
+    for(size_t idx = 0; idx < table_len; ++idx) {
+        table[idx].value = IR_NO_VALUE;
+    }
+    for(ir_value_t value = 0; value < program->num_values; ++value) {
+        replacement[value] = value;
+    }
+
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        ir_insn_t *insn = &program->insns[idx];
+        if(insn->a.is_value) {
+            insn->a.u.value = replacement[insn->a.u.value];
+        }
+        if(insn->opcode == IR_BINARY && insn->b.is_value) {
+            insn->b.u.value = replacement[insn->b.u.value];
+        }
+        if(insn->opcode != IR_BINARY) {
+            continue;
+        }
+
+        ir_cse_key_t key = ir_cse_key(insn);
+        // N.B. The table is at most half full, since it has room for two entries per instruction.
+        size_t slot = ir_cse_hash(&key) & (table_len - 1);
+        while(table[slot].value != IR_NO_VALUE && !ir_cse_key_equal(&table[slot].key, &key)) {
+            slot = (slot + 1) & (table_len - 1);
+        }
+        if(table[slot].value == IR_NO_VALUE) {
+            table[slot] = (ir_cse_entry_t) { .key = key, .value = insn->dst };
+        }
+        else {
+            replacement[insn->dst] = table[slot].value;
+            insn->opcode = IR_NOP;
+        }
+    }
+
+    free(replacement);
+    free(table);
+}
+
+static ir_cse_key_t ir_cse_key(const ir_insn_t *insn) {
+    ir_cse_key_t key = { .operr = insn->operr, .a = insn->a, .b = insn->b };
+    if(ir_operand_order(key.a, key.b) <= 0) {
+        return key;
+    }
+    switch(key.operr) {
+        case OP_ADD2:
+        case OP_MUL2:
+        case OP_MULH2:
+        case OP_EQUL:
+        case OP_NEQL:
+            break;
+        case OP_GREA:
+            key.operr = OP_LESS;
+            break;
+        case OP_LESS:
+            key.operr = OP_GREA;
+            break;
+        default:
+            // Not commutative
+            return key;
+    }
+    key.a = insn->b;
+    key.b = insn->a;
+    return key;
+}
+
+// Any total order will do: literals before values, then by number.
+static int ir_operand_order(ir_operand_t lhs, ir_operand_t rhs) {
+    if(lhs.is_value != rhs.is_value) {
+        return lhs.is_value ? 1 : -1;
+    }
+    uint32_t lhs_bits = lhs.is_value ? lhs.u.value : (uint32_t) lhs.u.imm;
+    uint32_t rhs_bits = rhs.is_value ? rhs.u.value : (uint32_t) rhs.u.imm;
+    return (lhs_bits > rhs_bits) - (lhs_bits < rhs_bits);
+}
+
+static uint32_t ir_cse_hash(const ir_cse_key_t *key) {
+    uint32_t words[] = {
+        (uint32_t) key->operr,
+        key->a.is_value ? key->a.u.value : (uint32_t) key->a.u.imm,
+        key->b.is_value ? key->b.u.value : (uint32_t) key->b.u.imm,
+        (uint32_t) key->a.is_value << 1 | (uint32_t) key->b.is_value,
+    };
+    // FNV-1a, a word at a time
+    uint32_t hash = 2166136261u;
+    for(size_t idx = 0; idx < sizeof words / sizeof(*words); ++idx) {
+        hash ^= words[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool ir_cse_key_equal(const ir_cse_key_t *lhs, const ir_cse_key_t *rhs) {
+    return lhs->operr == rhs->operr && ir_operand_order(lhs->a, rhs->a) == 0 && ir_operand_order(lhs->b, rhs->b) == 0;
+}
+
+// Strength reduction: multiplying and dividing by a constant becomes shifts, additions and subtractions, plus one high
+// multiply by a magic reciprocal for divisors that aren't powers of two (Hacker's Delight, ch. 10). All of them are far
+// cheaper than idiv, and most are cheaper than imul. One instruction turns into several, so the program is rebuilt,
+// renumbering values as it goes.
+static void ir_pass_strength(ir_program_t *program) {
+    ir_program_t reduced = IR_PROGRAM_INIT;
+    ir_operand_t *renamed = malloc(program->num_values * sizeof(ir_operand_t));
+    // TODO: Compiler error if out of memory
+    assert(program->num_values == 0 || renamed != NULL);
+
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        ir_insn_t insn = program->insns[idx];
+        if(insn.a.is_value) {
+            insn.a = renamed[insn.a.u.value];
+        }
+        if(insn.opcode == IR_BINARY && insn.b.is_value) {
+            insn.b = renamed[insn.b.u.value];
+        }
+        switch(insn.opcode) {
+            case IR_MOV:
+                renamed[insn.dst] = ir_val(ir_emit_mov(&reduced, insn.a));
+                break;
+            case IR_BINARY:
+                renamed[insn.dst] = ir_reduce_binary(&reduced, &insn);
+                break;
+            case IR_RETURN:
+                ir_emit_return(&reduced, insn.a);
+                break;
+            case IR_LOAD:
+                renamed[insn.dst] = ir_val(ir_emit_load(&reduced, insn.slot));
+                break;
+            case IR_STORE:
+                ir_emit_store(&reduced, insn.slot, insn.a);
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(renamed);
+    free(program->insns);
+    *program = reduced;
+}
+
+static ir_operand_t ir_reduce_binary(ir_program_t *out, const ir_insn_t *insn) {
+    ir_operand_t x = insn->a;
+    ir_operand_t constant = insn->b;
+    if(insn->operr == OP_MUL2 && !x.is_value) {
+        x = insn->b;
+        constant = insn->a;
+    }
+    ir_operand_t result;
+    if(!x.is_value || constant.is_value) {
+        return ir_reduce_emit(out, insn->operr, insn->a, insn->b);
+    }
+
+    int32_t c = constant.u.imm;
+    switch(insn->operr) {
+        case OP_MUL2:
+            if(ir_reduce_multiply(out, x, (uint32_t) c, &result)) {
+                return result;
+            }
+            break;
+        case OP_DIV2:
+            // N.B. Division by 0 or -1 can trap, so it's left to idiv.
+            if(c != 0 && c != -1) {
+                return ir_reduce_divide(out, x, c);
+            }
+            break;
+        case OP_MOD2:
+            // x - x / c * c, which has the sign of x just like idiv's remainder. N.B. Flipping the sign of c doesn't
+            // change the answer, and saves negating the quotient.
+            if(c != 0 && c != -1) {
+                int32_t positive = (c < 0 && c != INT32_MIN) ? -c : c;
+                ir_operand_t quotient = ir_reduce_divide(out, x, positive);
+                ir_operand_t product;
+                if(!ir_reduce_multiply(out, quotient, (uint32_t) positive, &product)) {
+                    product = ir_reduce_emit(out, OP_MUL2, quotient, ir_imm(positive));
+                }
+                return ir_reduce_emit(out, OP_SUB2, x, product);
+            }
+            break;
+        default:
+            break;
+    }
+    return ir_reduce_emit(out, insn->operr, insn->a, insn->b);
+}
+
+// N.B. Returns false if imul is as good as it gets. The factor is unsigned since only its bits mod 2^32 matter.
+static bool ir_reduce_multiply(ir_program_t *out, ir_operand_t x, uint32_t factor, ir_operand_t *result) {
+    if(factor == 0) {
+        *result = ir_imm(0);
+    }
+    else if(factor == 1) {
+        *result = x;
+    }
+    else if(factor == UINT32_MAX) {
+        *result = ir_reduce_emit(out, OP_SUB2, ir_imm(0), x);
+    }
+    else if(ir_is_power_of_two(factor)) {
+        *result = ir_reduce_emit(out, OP_SHL2, x, ir_imm((int32_t) ir_log2(factor)));
+    }
+    else if(ir_is_power_of_two(0u - factor)) {
+        ir_operand_t shifted = ir_reduce_emit(out, OP_SHL2, x, ir_imm((int32_t) ir_log2(0u - factor)));
+        *result = ir_reduce_emit(out, OP_SUB2, ir_imm(0), shifted);
+    }
+    else if(ir_is_power_of_two(factor - 1)) {
+        // x * 3, 5 and 9 come out as a single lea.
+        ir_operand_t shifted = ir_reduce_emit(out, OP_SHL2, x, ir_imm((int32_t) ir_log2(factor - 1)));
+        *result = ir_reduce_emit(out, OP_ADD2, x, shifted);
+    }
+    else if(ir_is_power_of_two(factor + 1)) {
+        ir_operand_t shifted = ir_reduce_emit(out, OP_SHL2, x, ir_imm((int32_t) ir_log2(factor + 1)));
+        *result = ir_reduce_emit(out, OP_SUB2, shifted, x);
+    }
+    else {
+        // (2^j + 1) * 2^k for a small j: a lea and a shift
+        uint32_t low = factor & (0u - factor);
+        uint32_t odd = factor / low;
+        if(odd != 3 && odd != 5 && odd != 9) {
+            return false;
+        }
+        ir_operand_t shifted = ir_reduce_emit(out, OP_SHL2, x, ir_imm((int32_t) ir_log2(odd - 1)));
+        ir_operand_t sum = ir_reduce_emit(out, OP_ADD2, x, shifted);
+        *result = ir_reduce_emit(out, OP_SHL2, sum, ir_imm((int32_t) ir_log2(low)));
+    }
+    return true;
+}
+
+// Rounds toward zero like idiv. N.B. The divisor is neither 0 nor -1, and INT_MIN counts as 2^31.
+static ir_operand_t ir_reduce_divide(ir_program_t *out, ir_operand_t x, int32_t divisor) {
+    uint32_t magnitude = (divisor < 0) ? 0u - (uint32_t) divisor : (uint32_t) divisor;
+    ir_operand_t quotient;
+    if(magnitude == 1) {
+        quotient = x;
+    }
+    else if(ir_is_power_of_two(magnitude)) {
+        // An arithmetic shift rounds down, so negative dividends are first biased by |c| - 1.
+        uint32_t shift = ir_log2(magnitude);
+        ir_operand_t sign = x;
+        if(shift > 1) {
+            sign = ir_reduce_emit(out, OP_SHR2, x, ir_imm(31));
+        }
+        ir_operand_t bias = ir_reduce_emit(out, OP_SHRU2, sign, ir_imm((int32_t) (32 - shift)));
+        ir_operand_t biased = ir_reduce_emit(out, OP_ADD2, x, bias);
+        quotient = ir_reduce_emit(out, OP_SHR2, biased, ir_imm((int32_t) shift));
+    }
+    else {
+        int32_t multiplier;
+        uint32_t shift;
+        ir_magic_divisor(magnitude, &multiplier, &shift);
+        ir_operand_t high = ir_reduce_emit(out, OP_MULH2, x, ir_imm(multiplier));
+        if(multiplier < 0) {
+            high = ir_reduce_emit(out, OP_ADD2, high, x);
+        }
+        if(shift > 0) {
+            high = ir_reduce_emit(out, OP_SHR2, high, ir_imm((int32_t) shift));
+        }
+        // Plus one for negative dividends, which the multiply rounded down
+        ir_operand_t sign = ir_reduce_emit(out, OP_SHRU2, x, ir_imm(31));
+        quotient = ir_reduce_emit(out, OP_ADD2, high, sign);
+    }
+    if(divisor < 0) {
+        quotient = ir_reduce_emit(out, OP_SUB2, ir_imm(0), quotient);
+    }
+    return quotient;
+}
+
+// The multiplier and shift for signed division by 2 <= divisor < 2^31, not a power of two (Hacker's Delight, fig.
+// 10-1, for positive divisors only).
+static void ir_magic_divisor(uint32_t divisor, int32_t *multiplier, uint32_t *shift) {
+    const uint32_t two31 = 0x80000000u;
+    uint32_t limit = two31 - 1 - two31 % divisor;
+    uint32_t power = 31;
+    uint32_t q1 = two31 / limit;
+    uint32_t r1 = two31 - q1 * limit;
+    uint32_t q2 = two31 / divisor;
+    uint32_t r2 = two31 - q2 * divisor;
+    uint32_t delta;
+    do {
+        ++power;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= limit) {
+            ++q1;
+            r1 -= limit;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= divisor) {
+            ++q2;
+            r2 -= divisor;
+        }
+        delta = divisor - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+    *multiplier = (int32_t) (q2 + 1);
+    *shift = power - 32;
+}
+
+static ir_operand_t ir_reduce_emit(ir_program_t *out, parse_node_operator_t operr, ir_operand_t a, ir_operand_t b) {
+    return ir_val(ir_emit_binary(out, operr, a, b));
+}
+
+static uint32_t ir_log2(uint32_t power) {
+    uint32_t log = 0;
+    while(power > 1) {
+        power >>= 1;
+        ++log;
+    }
+    return log;
+}
+
+static bool ir_is_power_of_two(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Dead code elimination, by liveness run backward over the whole program. Only IR_RETURN (and IR_STORE, whose slot a
+// later JIT line may read) is observable, and the only other side effect is a division that might trap; so whatever
+// they don't depend on, directly or not, is deleted. That covers lines whose value is thrown away as well as
+// assignments that are overwritten before anything reads them.
+static void ir_pass_dce(ir_program_t *program) {
+    bool *live = calloc(program->num_values, sizeof(bool));
+    // TODO: Compiler error if out of memory
+    assert(program->num_values == 0 || live != NULL);
+
+    for(size_t idx = program->len; idx-- > 0;) {
+        ir_insn_t *insn = &program->insns[idx];
+        if(ir_defines_value(insn) && !live[insn->dst] && !ir_may_trap(insn)) {
+            insn->opcode = IR_NOP;
+            continue;
+        }
+        if(insn->opcode == IR_NOP) {
+            continue;
+        }
+        if(insn->a.is_value) {
+            live[insn->a.u.value] = true;
+        }
+        if(insn->opcode == IR_BINARY && insn->b.is_value) {
+            live[insn->b.u.value] = true;
+        }
+    }
+
+    free(live);
+}
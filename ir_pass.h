@@ -0,0 +1,9 @@
+#pragma once
+
+#include "ir.h"
+
+#include <stdbool.h>
+
+// Runs every optimization pass over the program, in order. With `report`, each pass's effect on the instruction
+// count goes to stderr.
+void ir_run_passes(ir_program_t *program, bool report);
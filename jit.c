@@ -0,0 +1,154 @@
+#include "jit.h"
+#include "x86_encode.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_STACK_LEN ((size_t) 8 << 20)
+#define INIT_JIT_VARIABLES ((size_t) 1 << 20)
+#define JIT_VARIABLES_GROWTH_FACTOR ((size_t) 2)
+#define JIT_CODE_CHUNK_LEN ((size_t) 1 << 20)
+
+// jit_enter(code, stack_top, context): calls code with %rsp = stack_top (and context still in %rdx), and returns its
+// result. With the standard prologue, code's %rbp then ends up 16 below stack_top, which is where
+// X86_VARIABLE_SLOT_OFFSET() expects it.
+static const uint8_t jit_enter_code[] = {
+    0x53,                   // pushq %rbx
+    0x48, 0x89, 0xE3,       // movq %rsp, %rbx
+    0x48, 0x89, 0xF4,       // movq %rsi, %rsp
+    0xFF, 0xD7,             // call *%rdi
+    0x48, 0x89, 0xDC,       // movq %rbx, %rsp
+    0x5B,                   // popq %rbx
+    0xC3,                   // ret
+};
+static const uint8_t ret_code[] = { 0xC3 };
+
+typedef int (*jit_enter_t)(void *code, void *stack_top, void *context);
+
+static bool jit_has_been_initialized = false;
+static jit_enter_t jit_enter;
+// The stack, with the variable slots right on top of it. Both are only backed by memory once touched.
+static uint8_t *jit_stack = NULL;
+static size_t jit_variables = 0;
+
+// Code is bump-allocated from the current chunk, which is only writable while a program is being copied in.
+// N.B. Every program runs exactly once, so a full chunk's memory is handed back. It stays mapped, though: the perf map
+// still names programs at those addresses, and a later chunk landing there would overlap them.
+static uint8_t *jit_code = NULL;
+static size_t jit_code_len = 0;
+static size_t jit_code_used = 0;
+
+static FILE *jit_perf_map = NULL;
+static size_t jit_num_programs = 0;
+
+static void jit_init(void);
+static uint8_t *jit_code_alloc(size_t len);
+static void jit_code_protect(uint8_t *code, size_t len, int prot);
+static void *jit_map(size_t len, int prot);
+
+int jit_run(const insn_buffer_t *program) {
+    code_buffer_t code = CODE_BUFFER_INIT;
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        x86_encode(&code, &program->insns[idx], 0);
+    }
+    code_buffer_append(&code, ret_code, sizeof ret_code);
+
+    int res = jit_run_code(&code, NULL);
+    code_buffer_free(&code);
+    return res;
+}
+
+int jit_run_code(const code_buffer_t *code, void *context) {
+    if(!jit_has_been_initialized) {
+        jit_init();
+    }
+
+    uint8_t *entry = jit_code_alloc(code->len);
+    memcpy(entry, code->bytes, code->len);
+    jit_code_protect(entry, code->len, PROT_READ | PROT_EXEC);
+
+    if(jit_perf_map != NULL) {
+        fprintf(jit_perf_map, "%lx %zx et_line_%zu\n", (unsigned long) (uintptr_t) entry, code->len, ++jit_num_programs);
+        fflush(jit_perf_map);
+    }
+
+    return jit_enter(entry, jit_stack + JIT_STACK_LEN, context);
+}
+
+void jit_reserve_variables(size_t count) {
+    if(!jit_has_been_initialized) {
+        jit_init();
+    }
+    if(count <= jit_variables) {
+        return;
+    }
+    size_t new_variables = jit_variables;
+    while(new_variables < count) {
+        new_variables *= JIT_VARIABLES_GROWTH_FACTOR;
+    }
+    // N.B. The slots sit on top of the stack, so the whole mapping grows (and maybe moves) together. Nothing points into
+    // it between programs.
+    void *mem = mremap(jit_stack, JIT_STACK_LEN + jit_variables * 4, JIT_STACK_LEN + new_variables * 4, MREMAP_MAYMOVE);
+    // TODO: Compiler error if out of memory
+    assert(mem != MAP_FAILED);
+    jit_stack = mem;
+    jit_variables = new_variables;
+}
+
+static void jit_init(void) {
+    void *enter = jit_map(sizeof jit_enter_code, PROT_READ | PROT_WRITE);
+    memcpy(enter, jit_enter_code, sizeof jit_enter_code);
+    int res = mprotect(enter, sizeof jit_enter_code, PROT_READ | PROT_EXEC);
+    // TODO: Compiler error if we can't make the code executable
+    assert(res == 0);
+    // N.B. ISO C has no conversion from object pointers to function pointers, so copy the bits.
+    memcpy(&jit_enter, &enter, sizeof jit_enter);
+
+    jit_stack = jit_map(JIT_STACK_LEN + INIT_JIT_VARIABLES * 4, PROT_READ | PROT_WRITE);
+    jit_variables = INIT_JIT_VARIABLES;
+
+    // perf is optional, so never mind if this doesn't work out.
+    char path[64];
+    snprintf(path, sizeof path, "/tmp/perf-%ld.map", (long) getpid());
+    jit_perf_map = fopen(path, "w");
+
+    jit_has_been_initialized = true;
+}
+
+static uint8_t *jit_code_alloc(size_t len) {
+    if(jit_code == NULL || len > jit_code_len - jit_code_used) {
+        if(jit_code != NULL) {
+            madvise(jit_code, jit_code_len, MADV_DONTNEED);
+        }
+        size_t page_len = (size_t) sysconf(_SC_PAGESIZE);
+        jit_code_len = len > JIT_CODE_CHUNK_LEN ? (len + page_len - 1) / page_len * page_len : JIT_CODE_CHUNK_LEN;
+        jit_code = jit_map(jit_code_len, PROT_READ | PROT_WRITE);
+        jit_code_used = 0;
+    }
+    uint8_t *code = jit_code + jit_code_used;
+    jit_code_protect(code, len, PROT_READ | PROT_WRITE);
+    jit_code_used += len;
+    return code;
+}
+
+// Only the pages the code is on
+static void jit_code_protect(uint8_t *code, size_t len, int prot) {
+    uintptr_t page_len = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) code / page_len * page_len;
+    uintptr_t end = ((uintptr_t) code + len + page_len - 1) / page_len * page_len;
+    int res = mprotect((void *) start, end - start, prot);
+    // TODO: Compiler error if we can't change the protection
+    assert(res == 0);
+}
+
+static void *jit_map(size_t len, int prot) {
+    void *mem = mmap(NULL, len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    // TODO: Compiler error if out of memory
+    assert(mem != MAP_FAILED);
+    return mem;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "insn_buffer.h"
+#include "x86_encode.h"
+
+#include <stdint.h>
+
+// How many variable slots the JIT can keep (IR_LOAD/IR_STORE slots must be below this): as many as a 32-bit
+// displacement off %rbp reaches (see X86_VARIABLE_SLOT_OFFSET())
+#define JIT_MAX_VARIABLES (((uint32_t) 1 << 29) - 4)
+
+// Encodes the (register-allocated) program into executable memory and calls it, returning its result. Every program
+// runs on the JIT's own stack, right below the variable slots, so that variables keep their values from one program to
+// the next. Each program is also listed in /tmp/perf-<pid>.map for perf.
+int jit_run(const insn_buffer_t *program);
+
+// Makes sure there are at least `count` variable slots (at most JIT_MAX_VARIABLES). Slots keep their values as the
+// region grows.
+void jit_reserve_variables(size_t count);
+
+// Runs machine code that is encoded already (and ends in a ret) just like jit_run() does, with `context` in %rdx.
+int jit_run_code(const code_buffer_t *code, void *context);
@@ -0,0 +1,390 @@
+#include "jit_lanes.h"
+#include "jit.h"
+#include "output.h"
+#include "stats.h"
+#include "x86_encode.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keeps a group's frame (and its code) small
+#define JIT_LANES_MAX_VALUES 4096
+#define JIT_LANES_MAX_INSNS 4096
+
+// Where the group's program keeps things, below %rbp: one 16-byte lane vector per IR value, then two scratch vectors
+// for immediate operands, then a vector of ones to turn the all-ones of a packed comparison into 1.
+#define LANES_VALUE_OFFSET(value) (-16 * ((int32_t) (value) + 1))
+#define LANES_SCRATCH_A(num_values) LANES_VALUE_OFFSET(num_values)
+#define LANES_SCRATCH_B(num_values) LANES_VALUE_OFFSET((num_values) + 1)
+#define LANES_ONES(num_values) LANES_VALUE_OFFSET((num_values) + 2)
+#define LANES_FRAME_LEN(num_values) (16 * ((int32_t) (num_values) + 3))
+
+// The SSE2 opcodes (after 66 0F) that work on xmm0 and a memory operand
+#define SSE_MOVDQA_LOAD 0x6F
+#define SSE_MOVDQA_STORE 0x7F
+#define SSE_PADDD 0xFE
+#define SSE_PSUBD 0xFA
+#define SSE_PCMPEQD 0x76
+#define SSE_PCMPGTD 0x66
+#define SSE_PAND 0xDB
+#define SSE_PANDN 0xDF
+
+// The waiting lines, each copied whole. They are isomorphic: the same instructions on the same values, so only
+// immediates and slots differ from lane to lane.
+static ir_program_t lanes[JIT_LANES];
+static size_t lanes_len = 0;
+
+// Which group last loaded or stored each slot, to keep lines in a group from depending on each other
+static uint32_t *slot_loaded = NULL;
+static uint32_t *slot_stored = NULL;
+static size_t slot_stamps_len = 0;
+static uint32_t group_id = 1;
+
+static bool lanes_vectorizable(const ir_program_t *line);
+static bool lanes_isomorphic(const ir_program_t *leader, const ir_program_t *line);
+static bool lanes_independent(const ir_program_t *line);
+static void lanes_copy(ir_program_t *lane, const ir_program_t *line);
+static void lanes_run(void);
+static void slot_stamps_reserve(size_t len);
+static void emit_group(code_buffer_t *code);
+static int32_t emit_operand(code_buffer_t *code, size_t idx, bool second, int32_t scratch);
+static void emit_binary(code_buffer_t *code, parse_node_operator_t operr, int32_t a, int32_t b, int32_t ones);
+static void emit_sse(code_buffer_t *code, uint8_t opcode, int32_t disp);
+static void emit_movl_imm(code_buffer_t *code, int32_t disp, int imm);
+static void emit_movl_ecx(code_buffer_t *code, uint8_t opcode, int32_t disp);
+static void emit_u32(code_buffer_t *code, uint32_t value);
+
+bool jit_lanes_add(const ir_program_t *line, const x86_emit_options_t *options) {
+    if(!lanes_vectorizable(line)) {
+        return false;
+    }
+    if(lanes_len > 0 && (!lanes_isomorphic(&lanes[0], line) || !lanes_independent(line))) {
+        jit_lanes_flush(options);
+    }
+    if(lanes_len == 0) {
+        ++group_id;
+        // A fresh group holds nothing else, so this only marks the slots
+        lanes_independent(line);
+    }
+
+    lanes_copy(&lanes[lanes_len++], line);
+    if(lanes_len == JIT_LANES) {
+        lanes_run();
+    }
+    return true;
+}
+
+void jit_lanes_flush(const x86_emit_options_t *options) {
+    if(lanes_len == 1) {
+        lanes_len = 0;
+        x86_emit_program(&lanes[0], options);
+    }
+    else if(lanes_len > 1) {
+        lanes_run();
+    }
+}
+
+void jit_lanes_reset(void) {
+    lanes_len = 0;
+}
+
+// Only instructions with a packed form, with the values fitting in the frame
+static bool lanes_vectorizable(const ir_program_t *line) {
+    if(line->num_values > JIT_LANES_MAX_VALUES || line->len > JIT_LANES_MAX_INSNS) {
+        return false;
+    }
+    for(size_t idx = 0; idx < line->len; ++idx) {
+        const ir_insn_t *insn = &line->insns[idx];
+        if(insn->opcode != IR_BINARY) {
+            continue;
+        }
+        switch(insn->operr) {
+            case OP_ADD2:
+            case OP_SUB2:
+            case OP_EQUL:
+            case OP_NEQL:
+            case OP_GREA:
+            case OP_LESS:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool lanes_operand_isomorphic(ir_operand_t lhs, ir_operand_t rhs) {
+    return lhs.is_value == rhs.is_value && (!lhs.is_value || lhs.u.value == rhs.u.value);
+}
+
+static bool lanes_isomorphic(const ir_program_t *leader, const ir_program_t *line) {
+    if(leader->len != line->len || leader->num_values != line->num_values) {
+        return false;
+    }
+    for(size_t idx = 0; idx < line->len; ++idx) {
+        const ir_insn_t *lhs = &leader->insns[idx];
+        const ir_insn_t *rhs = &line->insns[idx];
+        if(lhs->opcode != rhs->opcode) {
+            return false;
+        }
+        switch(lhs->opcode) {
+            case IR_NOP:
+                break;
+            case IR_BINARY:
+                if(lhs->operr != rhs->operr || !lanes_operand_isomorphic(lhs->b, rhs->b)) {
+                    return false;
+                }
+                // fallthrough
+            case IR_MOV:
+                if(lhs->dst != rhs->dst) {
+                    return false;
+                }
+                // fallthrough
+            case IR_RETURN:
+            case IR_STORE:
+                if(!lanes_operand_isomorphic(lhs->a, rhs->a)) {
+                    return false;
+                }
+                break;
+            case IR_LOAD:
+                if(lhs->dst != rhs->dst) {
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+// Whether the line neither loads a slot an earlier line in the group stored, nor stores one an earlier line loaded or
+// stored. Marks the line's own slots if so.
+// N.B. Lanes run one instruction at a time for all of them, so any of those would see the other line's value too early
+// (or too late).
+static bool lanes_independent(const ir_program_t *line) {
+    for(size_t idx = 0; idx < line->len; ++idx) {
+        const ir_insn_t *insn = &line->insns[idx];
+        if(insn->opcode != IR_LOAD && insn->opcode != IR_STORE) {
+            continue;
+        }
+        slot_stamps_reserve((size_t) insn->slot + 1);
+        if(slot_stored[insn->slot] == group_id || (insn->opcode == IR_STORE && slot_loaded[insn->slot] == group_id)) {
+            return false;
+        }
+    }
+    for(size_t idx = 0; idx < line->len; ++idx) {
+        const ir_insn_t *insn = &line->insns[idx];
+        if(insn->opcode == IR_LOAD) {
+            slot_loaded[insn->slot] = group_id;
+        }
+    }
+    // N.B. Only now, since a line may store a slot after loading it itself
+    for(size_t idx = 0; idx < line->len; ++idx) {
+        const ir_insn_t *insn = &line->insns[idx];
+        if(insn->opcode == IR_STORE) {
+            slot_stored[insn->slot] = group_id;
+        }
+    }
+    return true;
+}
+
+static void lanes_copy(ir_program_t *lane, const ir_program_t *line) {
+    if(lane->cap < line->len) {
+        ir_insn_t *new_insns = realloc(lane->insns, line->len * sizeof(ir_insn_t));
+        // TODO: Compiler error if out of memory!
+        assert(new_insns != NULL);
+        lane->insns = new_insns;
+        lane->cap = line->len;
+    }
+    memcpy(lane->insns, line->insns, line->len * sizeof(ir_insn_t));
+    lane->len = line->len;
+    lane->num_values = line->num_values;
+}
+
+// Runs the group as one program and prints each line's value in turn. Lanes past the last line (when the group is run
+// early) repeat the first one, but store nothing.
+static void lanes_run(void) {
+    stats_phase_push(STATS_PHASE_RUN);
+    code_buffer_t code = CODE_BUFFER_INIT;
+    emit_group(&code);
+    int results[JIT_LANES];
+    jit_run_code(&code, results);
+    code_buffer_free(&code);
+
+    for(size_t lane = 0; lane < lanes_len; ++lane) {
+        // Just like the putint footer would
+        output_int(results[lane]);
+        output_char('\n');
+    }
+    lanes_len = 0;
+    stats_phase_pop();
+}
+
+static void slot_stamps_reserve(size_t len) {
+    if(len <= slot_stamps_len) {
+        return;
+    }
+    size_t new_len = slot_stamps_len ? slot_stamps_len : 1024;
+    while(new_len < len) {
+        new_len *= 2;
+    }
+    uint32_t *new_loaded = realloc(slot_loaded, new_len * sizeof(uint32_t));
+    uint32_t *new_stored = new_loaded != NULL ? realloc(slot_stored, new_len * sizeof(uint32_t)) : NULL;
+    // TODO: Compiler error if out of memory!
+    assert(new_loaded != NULL && new_stored != NULL);
+    memset(new_loaded + slot_stamps_len, 0, (new_len - slot_stamps_len) * sizeof(uint32_t));
+    memset(new_stored + slot_stamps_len, 0, (new_len - slot_stamps_len) * sizeof(uint32_t));
+    slot_loaded = new_loaded;
+    slot_stored = new_stored;
+    slot_stamps_len = new_len;
+}
+
+static void emit_group(code_buffer_t *code) {
+    const ir_program_t *leader = &lanes[0];
+    ir_value_t num_values = leader->num_values;
+    static const uint8_t prologue[] = {
+        0x55,               // pushq %rbp
+        0x48, 0x89, 0xE5,   // movq %rsp, %rbp
+        0x48, 0x81, 0xEC,   // subq $imm32, %rsp
+    };
+    code_buffer_append(code, prologue, sizeof prologue);
+    emit_u32(code, (uint32_t) LANES_FRAME_LEN(num_values));
+    for(size_t lane = 0; lane < JIT_LANES; ++lane) {
+        emit_movl_imm(code, LANES_ONES(num_values) + 4 * (int32_t) lane, 1);
+    }
+
+    for(size_t idx = 0; idx < leader->len; ++idx) {
+        const ir_insn_t *insn = &leader->insns[idx];
+        switch(insn->opcode) {
+            case IR_NOP:
+                break;
+            case IR_MOV: {
+                int32_t a = emit_operand(code, idx, false, LANES_VALUE_OFFSET(insn->dst));
+                if(a != LANES_VALUE_OFFSET(insn->dst)) {
+                    emit_sse(code, SSE_MOVDQA_LOAD, a);
+                    emit_sse(code, SSE_MOVDQA_STORE, LANES_VALUE_OFFSET(insn->dst));
+                }
+                break;
+            }
+            case IR_BINARY: {
+                int32_t a = emit_operand(code, idx, false, LANES_SCRATCH_A(num_values));
+                int32_t b = emit_operand(code, idx, true, LANES_SCRATCH_B(num_values));
+                emit_binary(code, insn->operr, a, b, LANES_ONES(num_values));
+                emit_sse(code, SSE_MOVDQA_STORE, LANES_VALUE_OFFSET(insn->dst));
+                break;
+            }
+            case IR_RETURN: {
+                static const uint8_t store_results[] = { 0xF3, 0x0F, 0x7F, 0x02 }; // movdqu %xmm0, (%rdx)
+                emit_sse(code, SSE_MOVDQA_LOAD, emit_operand(code, idx, false, LANES_SCRATCH_A(num_values)));
+                code_buffer_append(code, store_results, sizeof store_results);
+                break;
+            }
+            case IR_LOAD:
+                for(size_t lane = 0; lane < JIT_LANES; ++lane) {
+                    const ir_insn_t *lane_insn = &lanes[lane < lanes_len ? lane : 0].insns[idx];
+                    emit_movl_ecx(code, 0x8B, X86_VARIABLE_SLOT_OFFSET(lane_insn->slot));
+                    emit_movl_ecx(code, 0x89, LANES_VALUE_OFFSET(insn->dst) + 4 * (int32_t) lane);
+                }
+                break;
+            case IR_STORE:
+                // N.B. Only the lanes that hold a line, since the others would store into the first line's slot
+                for(size_t lane = 0; lane < lanes_len; ++lane) {
+                    const ir_insn_t *lane_insn = &lanes[lane].insns[idx];
+                    if(lane_insn->a.is_value) {
+                        emit_movl_ecx(code, 0x8B, LANES_VALUE_OFFSET(lane_insn->a.u.value) + 4 * (int32_t) lane);
+                        emit_movl_ecx(code, 0x89, X86_VARIABLE_SLOT_OFFSET(lane_insn->slot));
+                    }
+                    else {
+                        emit_movl_imm(code, X86_VARIABLE_SLOT_OFFSET(lane_insn->slot), lane_insn->a.u.imm);
+                    }
+                }
+                break;
+        }
+    }
+
+    static const uint8_t epilogue[] = {
+        0x31, 0xC0,         // xorl %eax, %eax
+        0xC9,               // leave
+        0xC3,               // ret
+    };
+    code_buffer_append(code, epilogue, sizeof epilogue);
+}
+
+// Where operand a (or b) of instruction `idx` is, writing each lane's immediate to `scratch` first if it's one.
+static int32_t emit_operand(code_buffer_t *code, size_t idx, bool second, int32_t scratch) {
+    const ir_insn_t *insn = &lanes[0].insns[idx];
+    ir_operand_t operand = second ? insn->b : insn->a;
+    if(operand.is_value) {
+        return LANES_VALUE_OFFSET(operand.u.value);
+    }
+    for(size_t lane = 0; lane < JIT_LANES; ++lane) {
+        const ir_insn_t *lane_insn = &lanes[lane < lanes_len ? lane : 0].insns[idx];
+        emit_movl_imm(code, scratch + 4 * (int32_t) lane, second ? lane_insn->b.u.imm : lane_insn->a.u.imm);
+    }
+    return scratch;
+}
+
+// %xmm0 = a operr b, lane by lane
+static void emit_binary(code_buffer_t *code, parse_node_operator_t operr, int32_t a, int32_t b, int32_t ones) {
+    switch(operr) {
+        case OP_ADD2:
+            emit_sse(code, SSE_MOVDQA_LOAD, a);
+            emit_sse(code, SSE_PADDD, b);
+            break;
+        case OP_SUB2:
+            emit_sse(code, SSE_MOVDQA_LOAD, a);
+            emit_sse(code, SSE_PSUBD, b);
+            break;
+        case OP_EQUL:
+            emit_sse(code, SSE_MOVDQA_LOAD, a);
+            emit_sse(code, SSE_PCMPEQD, b);
+            emit_sse(code, SSE_PAND, ones);
+            break;
+        case OP_NEQL:
+            emit_sse(code, SSE_MOVDQA_LOAD, a);
+            emit_sse(code, SSE_PCMPEQD, b);
+            emit_sse(code, SSE_PANDN, ones);
+            break;
+        case OP_GREA:
+            emit_sse(code, SSE_MOVDQA_LOAD, a);
+            emit_sse(code, SSE_PCMPGTD, b);
+            emit_sse(code, SSE_PAND, ones);
+            break;
+        case OP_LESS:
+            emit_sse(code, SSE_MOVDQA_LOAD, b);
+            emit_sse(code, SSE_PCMPGTD, a);
+            emit_sse(code, SSE_PAND, ones);
+            break;
+        default:
+            // TODO: Only what lanes_vectorizable() lets through
+            assert(false);
+    }
+}
+
+// <op> disp(%rbp), %xmm0 (or the other way around for SSE_MOVDQA_STORE)
+static void emit_sse(code_buffer_t *code, uint8_t opcode, int32_t disp) {
+    const uint8_t bytes[] = { 0x66, 0x0F, opcode, 0x85 };
+    code_buffer_append(code, bytes, sizeof bytes);
+    emit_u32(code, (uint32_t) disp);
+}
+
+// movl $imm, disp(%rbp)
+static void emit_movl_imm(code_buffer_t *code, int32_t disp, int imm) {
+    const uint8_t bytes[] = { 0xC7, 0x85 };
+    code_buffer_append(code, bytes, sizeof bytes);
+    emit_u32(code, (uint32_t) disp);
+    emit_u32(code, (uint32_t) imm);
+}
+
+// movl disp(%rbp), %ecx (0x8B) or movl %ecx, disp(%rbp) (0x89)
+static void emit_movl_ecx(code_buffer_t *code, uint8_t opcode, int32_t disp) {
+    const uint8_t bytes[] = { opcode, 0x8D };
+    code_buffer_append(code, bytes, sizeof bytes);
+    emit_u32(code, (uint32_t) disp);
+}
+
+static void emit_u32(code_buffer_t *code, uint32_t value) {
+    const uint8_t bytes[] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF };
+    code_buffer_append(code, bytes, sizeof bytes);
+}
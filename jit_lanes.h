@@ -0,0 +1,27 @@
+#pragma once
+
+#include "ir.h"
+#include "x86_emit.h"
+
+#include <stdbool.h>
+
+// How many JIT lines run side by side, one per 32-bit lane of an SSE register
+#define JIT_LANES 4
+
+// Inputs with millions of short lines tend to repeat a handful of shapes (`x1 = 3 + 4; x2 = 5 + 6; ...`). Rather than
+// compile and enter one program per line, the JIT lets consecutive lines that differ only in their constants and
+// variables wait in a group, and runs the whole group as one program that computes each value for every line at once
+// with packed SSE2 instructions.
+
+// Takes (a copy of) the line into the waiting group, running the group once it's full. Returns false if the line can't
+// run in a group at all (it has an operation SSE2 has no packed form for, or it's too long); run whatever is waiting
+// before running it on its own then.
+// N.B. A line that has the wrong shape for the group, or touches a variable an earlier line in it assigned, runs the
+// group and starts a new one.
+bool jit_lanes_add(const ir_program_t *line, const x86_emit_options_t *options);
+
+// Runs (and prints) whatever lines are waiting. A lone line is compiled just like any other line.
+void jit_lanes_flush(const x86_emit_options_t *options);
+
+// Forgets the waiting lines without running them.
+void jit_lanes_reset(void);
@@ -0,0 +1,99 @@
+#include "output.h"
+#include "thread_local.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_LEN ((size_t) 1 << 16)
+// Enough for "-2147483648"
+#define OUTPUT_INT_MAX_LEN ((size_t) 11)
+
+static ET_THREAD_LOCAL char output_buffer[OUTPUT_BUFFER_LEN];
+static ET_THREAD_LOCAL size_t output_len = 0;
+static ET_THREAD_LOCAL int output_fd = STDOUT_FILENO;
+
+static void write_all(const char *bytes, size_t len);
+
+bool output_open(const char *path, bool executable) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, executable ? 0777 : 0666);
+    if(fd < 0) {
+        return false;
+    }
+    output_flush();
+    output_fd = fd;
+    return true;
+}
+
+void output_bytes(const char *bytes, size_t len) {
+    if(len > OUTPUT_BUFFER_LEN - output_len) {
+        output_flush();
+        if(len > OUTPUT_BUFFER_LEN) {
+            // Too big to be worth copying
+            write_all(bytes, len);
+            return;
+        }
+    }
+    memcpy(output_buffer + output_len, bytes, len);
+    output_len += len;
+}
+
+void output_str(const char *str) {
+    output_bytes(str, strlen(str));
+}
+
+void output_char(char c) {
+    if(output_len == OUTPUT_BUFFER_LEN) {
+        output_flush();
+    }
+    output_buffer[output_len++] = c;
+}
+
+void output_int(int32_t value) {
+    char digits[OUTPUT_INT_MAX_LEN];
+    size_t start = OUTPUT_INT_MAX_LEN;
+    // N.B. Negating INT32_MIN overflows, so the magnitude is computed unsigned.
+    uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    do {
+        digits[--start] = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude != 0);
+    if(value < 0) {
+        digits[--start] = '-';
+    }
+    output_bytes(digits + start, OUTPUT_INT_MAX_LEN - start);
+}
+
+void output_close(void) {
+    output_flush();
+    if(output_fd != STDOUT_FILENO) {
+        if(close(output_fd) != 0) {
+            perror("close");
+            exit(EXIT_FAILURE);
+        }
+        output_fd = STDOUT_FILENO;
+    }
+}
+
+void output_flush(void) {
+    write_all(output_buffer, output_len);
+    output_len = 0;
+}
+
+static void write_all(const char *bytes, size_t len) {
+    while(len > 0) {
+        ssize_t res = write(output_fd, bytes, len);
+        if(res < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        bytes += res;
+        len -= (size_t) res;
+    }
+}
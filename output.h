@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where the assembly goes. Everything is collected in one large buffer and handed to write(2) in big chunks, so
+// emitting an instruction costs a few byte copies rather than a round through stdio's format parsing.
+
+// Redirects output to `path` (created or truncated, and made executable if asked). Without a call to this, output goes
+// to stdout.
+// N.B. Returns false (with errno set) if the file can't be opened
+bool output_open(const char *path, bool executable);
+
+void output_bytes(const char *bytes, size_t len);
+void output_str(const char *str);
+void output_char(char c);
+void output_int(int32_t value);
+
+// Writes out whatever is buffered so far.
+void output_flush(void);
+
+// Writes out whatever is buffered, and closes the output file if output_open() opened one.
+void output_close(void);
@@ -1,6 +1,8 @@
 #ifndef PARSE_TREE_H_
 #define PARSE_TREE_H_
 
+#include "intern.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -18,8 +20,18 @@ typedef enum {
     OP_NEQL,
     OP_GREA,
     OP_LESS,
+    OP_MUL2,
+    OP_DIV2,
+    OP_MOD2,
+    OP_SHL2,
+    OP_SHR2,
+    // N.B. These two never come out of the parser; strength reduction builds them (ir_pass.c)
+    OP_SHRU2,   // Logical right shift
+    OP_MULH2,   // High half of the signed 64-bit product
 } parse_node_operator_t;
 
+#define PARSE_NODE_MAX_OPS ((size_t) 2)
+
 typedef struct parse_node parse_node_t;
 
 typedef struct {
@@ -27,7 +39,7 @@ typedef struct {
 } parse_node_int_t;
 
 typedef struct {
-    const char *identifier;
+    intern_id_t identifier;
     bool declaration;
     bool assignment;
     const parse_node_t *subexpr;
@@ -36,7 +48,7 @@ typedef struct {
 typedef struct {
     parse_node_operator_t operr;
     size_t num_ops;
-    const parse_node_t **ops;
+    const parse_node_t *ops[PARSE_NODE_MAX_OPS];
 } parse_node_operation_t;
 
 typedef union {
@@ -47,11 +59,19 @@ typedef union {
 
 struct parse_node {
     parse_node_tag_t type;
+    // Sethi-Ullman label: how many registers evaluating the subtree takes, not counting variables and literals, which
+    // are already there to be used as operands. Filled in by the constructors, which run bottom-up.
+    unsigned registers;
+    // Whether the subtree assigns a variable anywhere, which pins down the order it has to be evaluated in
+    bool assigns;
     parse_node_contents_t contents;
 };
 
+// N.B. Nodes live in a per-line arena: they are only valid until parse_line_reset(), which the parser calls once a line
+// has been code-generated. Anything that must outlive the line has to be copied.
 const parse_node_t *parse_node_int(int value);
-const parse_node_t *parse_node_var(bool declaration, bool assignment, const char *id, const parse_node_t *subexpr);
+const parse_node_t *parse_node_var(bool declaration, bool assignment, intern_id_t id, const parse_node_t *subexpr);
 const parse_node_t *parse_node_operation(parse_node_operator_t operr, size_t num_ops, const parse_node_t *node0, ...);
+void parse_line_reset(void);
 
 #endif
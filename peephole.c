@@ -0,0 +1,287 @@
+#include "peephole.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Physical registers plus the flags, as a bitmask (bit n is x86_register_t n)
+typedef uint32_t reg_set_t;
+
+#define REG_SET_BIT(reg) ((reg_set_t) 1 << (reg))
+#define REG_SET_FLAGS ((reg_set_t) 1 << X86_NUM_REGISTERS)
+#define REG_SET_CALLER_SAVED (REG_SET_BIT(X86_RAX) | REG_SET_BIT(X86_RCX) | REG_SET_BIT(X86_RDX) | \
+                              REG_SET_BIT(X86_RSI) | REG_SET_BIT(X86_RDI) | REG_SET_BIT(X86_R8) | \
+                              REG_SET_BIT(X86_R9) | REG_SET_BIT(X86_R10) | REG_SET_BIT(X86_R11) | REG_SET_FLAGS)
+// What the caller gets to see once we're done: the result, and everything we promised to preserve.
+#define REG_SET_LIVE_AT_EXIT (REG_SET_BIT(X86_RAX) | REG_SET_BIT(X86_RBX) | REG_SET_BIT(X86_RSP) | \
+                              REG_SET_BIT(X86_RBP) | REG_SET_BIT(X86_R12) | REG_SET_BIT(X86_R13) | \
+                              REG_SET_BIT(X86_R14) | REG_SET_BIT(X86_R15))
+
+// A rule looks at `window` consecutive instructions starting at `insns`, and rewrites them if it can. Instructions it
+// eliminates become INSN_NOPs. `live_after[n]` is what is live right after insns[n].
+// N.B. Returns the number of instructions eliminated
+typedef struct {
+    const char *name;
+    size_t window;
+    size_t (*apply)(insn_t *insns, const reg_set_t *live_after);
+} peephole_rule_t;
+
+static size_t rule_self_move(insn_t *insns, const reg_set_t *live_after);
+static size_t rule_dead_write(insn_t *insns, const reg_set_t *live_after);
+static size_t rule_add_zero(insn_t *insns, const reg_set_t *live_after);
+static size_t rule_xor_zero(insn_t *insns, const reg_set_t *live_after);
+static size_t rule_copy_chain(insn_t *insns, const reg_set_t *live_after);
+static void compute_liveness(const insn_buffer_t *buffer, reg_set_t *live_after);
+static reg_set_t insn_uses(const insn_t *insn);
+static reg_set_t insn_defs(const insn_t *insn);
+static reg_set_t operand_regs(const insn_operand_t *operand);
+static bool is_reg(const insn_operand_t *operand, x86_register_t reg);
+static void compact(insn_buffer_t *buffer);
+
+static const peephole_rule_t peephole_rules[] = {
+    { .name = "self-move", .window = 1, .apply = rule_self_move },
+    { .name = "dead-write", .window = 1, .apply = rule_dead_write },
+    { .name = "add-zero", .window = 1, .apply = rule_add_zero },
+    { .name = "xor-zero", .window = 1, .apply = rule_xor_zero },
+    // N.B. Keep PEEPHOLE_MAX_WINDOW in step with the widest of these
+    { .name = "copy-chain", .window = 2, .apply = rule_copy_chain },
+};
+#define PEEPHOLE_RULES_LEN (sizeof peephole_rules / sizeof(*peephole_rules))
+
+void peephole_optimize(insn_buffer_t *buffer, size_t window, bool report) {
+    size_t eliminated[PEEPHOLE_RULES_LEN] = { 0 };
+    size_t rewritten[PEEPHOLE_RULES_LEN] = { 0 };
+
+    bool changed = window > 0;
+    while(changed) {
+        changed = false;
+        reg_set_t *live_after = malloc(buffer->len * sizeof(reg_set_t));
+        // TODO: Compiler error if out of memory
+        assert(buffer->len == 0 || live_after != NULL);
+        compute_liveness(buffer, live_after);
+
+        for(size_t position = 0; position < buffer->len; ++position) {
+            for(size_t r_idx = 0; r_idx < PEEPHOLE_RULES_LEN; ++r_idx) {
+                const peephole_rule_t *rule = &peephole_rules[r_idx];
+                if(rule->window > window || position + rule->window > buffer->len) {
+                    continue;
+                }
+                bool any_nop = false;
+                for(size_t offset = 0; offset < rule->window; ++offset) {
+                    any_nop |= buffer->insns[position + offset].opcode == INSN_NOP;
+                }
+                if(any_nop) {
+                    continue;
+                }
+
+                insn_t before = buffer->insns[position];
+                size_t count = rule->apply(&buffer->insns[position], &live_after[position]);
+                if(count > 0 || buffer->insns[position].opcode != before.opcode) {
+                    eliminated[r_idx] += count;
+                    rewritten[r_idx] += (count == 0);
+                    // The liveness we computed no longer describes what follows; pick it up next round.
+                    changed = true;
+                    position += rule->window - 1;
+                    break;
+                }
+            }
+        }
+
+        free(live_after);
+        compact(buffer);
+    }
+
+    if(report) {
+        for(size_t r_idx = 0; r_idx < PEEPHOLE_RULES_LEN; ++r_idx) {
+            fprintf(stderr, "%-10s %zu instructions eliminated, %zu rewritten\n", peephole_rules[r_idx].name,
+                    eliminated[r_idx], rewritten[r_idx]);
+        }
+    }
+}
+
+// movl %r, %r
+static size_t rule_self_move(insn_t *insns, const reg_set_t *live_after) {
+    if(insns[0].opcode == INSN_MOVL && insns[0].src.kind == OPND_REG && is_reg(&insns[0].dst, insns[0].src.u.reg)) {
+        insns[0].opcode = INSN_NOP;
+        return 1;
+    }
+    return 0;
+}
+
+// Anything whose only effect is on registers (and flags) that nobody reads afterwards
+static size_t rule_dead_write(insn_t *insns, const reg_set_t *live_after) {
+    switch(insns[0].opcode) {
+        case INSN_MOVL:
+        case INSN_ADDL:
+        case INSN_SUBL:
+        case INSN_XORL:
+        case INSN_CMPL:
+        case INSN_LEAL:
+        case INSN_INCL:
+        case INSN_DECL:
+        case INSN_NEGL:
+        case INSN_IMULL:
+        case INSN_SALL:
+        case INSN_SARL:
+        case INSN_SHRL:
+        case INSN_CLTD:
+        case INSN_IMULL_WIDE:
+        case INSN_SETCC:
+        case INSN_MOVZBL:
+            break;
+        default:
+            // N.B. That includes idivl, which has to stay in case it traps.
+            return 0;
+    }
+    if(insn_writes_dst(&insns[0]) && insns[0].dst.kind != OPND_REG) {
+        // Stores to memory stay.
+        return 0;
+    }
+    if(insn_defs(&insns[0]) & live_after[0]) {
+        return 0;
+    }
+    insns[0].opcode = INSN_NOP;
+    return 1;
+}
+
+// addl $0, x / subl $0, x, as long as nobody looks at the flags
+static size_t rule_add_zero(insn_t *insns, const reg_set_t *live_after) {
+    if((insns[0].opcode == INSN_ADDL || insns[0].opcode == INSN_SUBL) &&
+       insns[0].src.kind == OPND_IMM && insns[0].src.u.imm == 0 && !(live_after[0] & REG_SET_FLAGS)) {
+        insns[0].opcode = INSN_NOP;
+        return 1;
+    }
+    return 0;
+}
+
+// movl $0, %r -> xorl %r, %r (shorter, and breaks the dependency on %r), as long as nobody looks at the flags
+static size_t rule_xor_zero(insn_t *insns, const reg_set_t *live_after) {
+    if(insns[0].opcode == INSN_MOVL && insns[0].src.kind == OPND_IMM && insns[0].src.u.imm == 0 &&
+       insns[0].dst.kind == OPND_REG && !(live_after[0] & REG_SET_FLAGS)) {
+        insns[0].opcode = INSN_XORL;
+        insns[0].src = insns[0].dst;
+    }
+    return 0;
+}
+
+// movl a, %r; movl %r, b -> movl a, b, when %r isn't needed afterwards
+static size_t rule_copy_chain(insn_t *insns, const reg_set_t *live_after) {
+    if(insns[0].opcode != INSN_MOVL || insns[1].opcode != INSN_MOVL || insns[0].dst.kind != OPND_REG) {
+        return 0;
+    }
+    x86_register_t middle = insns[0].dst.u.reg;
+    if(!is_reg(&insns[1].src, middle) || (live_after[1] & REG_SET_BIT(middle))) {
+        return 0;
+    }
+    if(insns[0].src.kind == OPND_MEM && insns[1].dst.kind == OPND_MEM) {
+        return 0;
+    }
+    insns[0].dst = insns[1].dst;
+    insns[1].opcode = INSN_NOP;
+    return 1;
+}
+
+// Backwards over the straight-line program
+static void compute_liveness(const insn_buffer_t *buffer, reg_set_t *live_after) {
+    reg_set_t live = REG_SET_LIVE_AT_EXIT;
+    for(size_t position = buffer->len; position-- > 0;) {
+        live_after[position] = live;
+        const insn_t *insn = &buffer->insns[position];
+        live = (live & ~insn_defs(insn)) | insn_uses(insn);
+    }
+}
+
+static reg_set_t insn_uses(const insn_t *insn) {
+    switch(insn->opcode) {
+        case INSN_NOP:
+            return 0;
+        case INSN_MOVL:
+        case INSN_MOVZBL:
+            // The destination only counts if it's used to address memory
+            return operand_regs(&insn->src) | (insn->dst.kind == OPND_MEM ? REG_SET_BIT(X86_RBP) : 0);
+        case INSN_XORL:
+            if(insn->src.kind == OPND_REG && is_reg(&insn->dst, insn->src.u.reg)) {
+                // Zeroing idiom
+                return 0;
+            }
+            return operand_regs(&insn->src) | operand_regs(&insn->dst);
+        case INSN_LEAL:
+            // Only the address; the destination is just written
+            return operand_regs(&insn->src) | operand_regs(&insn->index);
+        case INSN_SETCC:
+            return REG_SET_FLAGS | (insn->dst.kind == OPND_MEM ? REG_SET_BIT(X86_RBP) : 0);
+        case INSN_CALL:
+            return REG_SET_BIT(X86_RDI) | REG_SET_BIT(X86_RSP);
+        case INSN_CLTD:
+            return REG_SET_BIT(X86_RAX);
+        case INSN_IMULL_WIDE:
+            return operand_regs(&insn->src) | REG_SET_BIT(X86_RAX);
+        case INSN_IDIVL:
+            return operand_regs(&insn->src) | REG_SET_BIT(X86_RAX) | REG_SET_BIT(X86_RDX);
+        default:
+            // Conservatively, everything else reads all of its operands (and the frame instructions touch %rsp).
+            return operand_regs(&insn->src) | operand_regs(&insn->dst) | REG_SET_BIT(X86_RSP);
+    }
+}
+
+static reg_set_t insn_defs(const insn_t *insn) {
+    reg_set_t defs = 0;
+    if(insn_writes_dst(insn) && insn->dst.kind == OPND_REG) {
+        defs |= REG_SET_BIT(insn->dst.u.reg);
+    }
+    switch(insn->opcode) {
+        case INSN_ADDL:
+        case INSN_SUBL:
+        case INSN_XORL:
+        case INSN_CMPL:
+        case INSN_INCL:
+        case INSN_DECL:
+        case INSN_NEGL:
+        case INSN_IMULL:
+        case INSN_SALL:
+        case INSN_SARL:
+        case INSN_SHRL:
+            // N.B. Shifts by zero leave the flags alone, but nothing reads them across a shift anyway.
+            defs |= REG_SET_FLAGS;
+            break;
+        case INSN_CLTD:
+            defs |= REG_SET_BIT(X86_RDX);
+            break;
+        case INSN_IMULL_WIDE:
+        case INSN_IDIVL:
+            defs |= REG_SET_BIT(X86_RAX) | REG_SET_BIT(X86_RDX) | REG_SET_FLAGS;
+            break;
+        case INSN_CALL:
+            defs |= REG_SET_CALLER_SAVED;
+            break;
+        default:
+            break;
+    }
+    return defs;
+}
+
+static reg_set_t operand_regs(const insn_operand_t *operand) {
+    switch(operand->kind) {
+        case OPND_REG:
+            return REG_SET_BIT(operand->u.reg);
+        case OPND_MEM:
+            return REG_SET_BIT(X86_RBP);
+        default:
+            return 0;
+    }
+}
+
+static bool is_reg(const insn_operand_t *operand, x86_register_t reg) {
+    return operand->kind == OPND_REG && operand->u.reg == reg;
+}
+
+static void compact(insn_buffer_t *buffer) {
+    size_t kept = 0;
+    for(size_t position = 0; position < buffer->len; ++position) {
+        if(buffer->insns[position].opcode != INSN_NOP) {
+            buffer->insns[kept++] = buffer->insns[position];
+        }
+    }
+    buffer->len = kept;
+}
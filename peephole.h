@@ -0,0 +1,14 @@
+#pragma once
+
+#include "insn_buffer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The widest window any rule needs; a larger one wouldn't find anything more.
+#define PEEPHOLE_MAX_WINDOW ((size_t) 2)
+
+// Rewrites the (register-allocated) program in place until none of the rules that fit in `window` consecutive
+// instructions apply any more. A window of 0 leaves the program alone. With `report`, how many instructions each rule
+// eliminated goes to stderr.
+void peephole_optimize(insn_buffer_t *buffer, size_t window, bool report);
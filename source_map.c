@@ -0,0 +1,51 @@
+#include "source_map.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Handing pages back costs a system call, so only bother once there's a good number of them.
+#define SOURCE_MAP_RELEASE_LEN ((size_t) 16 << 20)
+
+bool source_map_open(int fd, source_map_t *map) {
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || lseek(fd, 0, SEEK_CUR) != 0) {
+        return false;
+    }
+    size_t len = (size_t) st.st_size;
+    size_t page_len = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mapped_len = (len + SOURCE_MAP_SENTINEL_LEN + page_len - 1) / page_len * page_len;
+
+    // Zeroed memory to put the file over: whatever it doesn't cover (past the end of the file's last page) stays zero,
+    // as does the rest of that page, so the sentinel is there either way.
+    char *bytes = mmap(NULL, mapped_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(bytes == MAP_FAILED) {
+        return false;
+    }
+    if(mmap(bytes, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(bytes, mapped_len);
+        return false;
+    }
+    // Never mind if the kernel won't take the hint.
+    madvise(bytes, len, MADV_SEQUENTIAL);
+
+    *map = (source_map_t) { .bytes = bytes, .len = len, .mapped_len = mapped_len, .released = 0 };
+    return true;
+}
+
+void source_map_release(source_map_t *map, const char *position) {
+    size_t page_len = (size_t) sysconf(_SC_PAGESIZE);
+    size_t done = (size_t) (position - map->bytes) / page_len * page_len;
+    if(done - map->released < SOURCE_MAP_RELEASE_LEN) {
+        return;
+    }
+    // N.B. For a private file mapping, this throws away our copies of the pages (and with them the NULs flex left
+    // behind): touching them again would just read the file afresh.
+    madvise(map->bytes + map->released, done - map->released, MADV_DONTNEED);
+    map->released = done;
+}
+
+void source_map_close(source_map_t *map) {
+    munmap(map->bytes, map->mapped_len);
+    *map = (source_map_t) { .bytes = NULL };
+}
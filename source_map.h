@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// flex's YY_END_OF_BUFFER_CHAR, twice: the mapping is this much longer than the file
+#define SOURCE_MAP_SENTINEL_LEN ((size_t) 2)
+
+// An input file mapped straight into memory, so the scanner can work on it in place instead of reading it through
+// buffers of its own. The mapping is private and writable (flex NUL-terminates each token in place while it runs its
+// action), and followed by the two NUL bytes flex wants at the end of a buffer.
+typedef struct {
+    char *bytes;
+    size_t len;
+    size_t mapped_len;
+    // Everything before this has already been handed back by source_map_release()
+    size_t released;
+} source_map_t;
+
+// N.B. Returns false if fd isn't a regular file (or is empty, or positioned anywhere but its start), or can't be mapped;
+// the caller should read it the usual way then.
+bool source_map_open(int fd, source_map_t *map);
+
+// Lets go of the pages the scanner is done with, i.e. those before `position`, so that a huge input doesn't end up
+// entirely in memory (copy-on-write makes every page it has scanned the process's own).
+void source_map_release(source_map_t *map, const char *position);
+
+void source_map_close(source_map_t *map);
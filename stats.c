@@ -0,0 +1,198 @@
+#include "stats.h"
+#include "thread_local.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STATS_MAX_NESTING ((size_t) 16)
+// Past this, events are dropped (and counted) rather than letting the trace grow without bound.
+#define STATS_MAX_TRACE_EVENTS ((size_t) 1 << 20)
+#define INIT_TRACE_EVENTS_LEN ((size_t) 1024)
+#define TRACE_EVENTS_GROWTH_FACTOR ((size_t) 2)
+#define NODE_TAG_COUNT ((size_t) NODE_TYPE_OPERATION + 1)
+
+typedef struct {
+    stats_phase_t phase;
+    uint64_t start_ns;
+} stats_frame_t;
+
+typedef struct {
+    stats_phase_t phase;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} stats_trace_event_t;
+
+static const char *const phase_names[STATS_NUM_PHASES] = {
+    [STATS_PHASE_LEX] = "lex",
+    [STATS_PHASE_PARSE] = "parse",
+    [STATS_PHASE_FOLD] = "fold",
+    [STATS_PHASE_LOWER] = "lower",
+    [STATS_PHASE_IR_PASSES] = "ir passes",
+    [STATS_PHASE_ISEL] = "isel",
+    [STATS_PHASE_REGALLOC] = "regalloc",
+    [STATS_PHASE_PEEPHOLE] = "peephole",
+    [STATS_PHASE_WRITE] = "write",
+    [STATS_PHASE_RUN] = "run",
+};
+
+static const char *const node_tag_names[NODE_TAG_COUNT] = {
+    [NODE_TYPE_INT] = "int",
+    [NODE_TYPE_VAR] = "var",
+    [NODE_TYPE_OPERATION] = "operation",
+};
+
+static ET_THREAD_LOCAL bool stats_enabled = false;
+static ET_THREAD_LOCAL bool stats_tracing = false;
+static ET_THREAD_LOCAL uint64_t stats_epoch_ns = 0;
+
+static ET_THREAD_LOCAL stats_frame_t phase_stack[STATS_MAX_NESTING];
+static ET_THREAD_LOCAL size_t phase_depth = 0;
+// When the innermost phase was last charged
+static ET_THREAD_LOCAL uint64_t phase_last_ns = 0;
+static ET_THREAD_LOCAL uint64_t phase_ns[STATS_NUM_PHASES] = { 0 };
+static ET_THREAD_LOCAL size_t phase_entries[STATS_NUM_PHASES] = { 0 };
+
+static ET_THREAD_LOCAL stats_trace_event_t *trace_events = NULL;
+static ET_THREAD_LOCAL size_t trace_events_len = 0;
+static ET_THREAD_LOCAL size_t trace_events_cap = 0;
+static ET_THREAD_LOCAL size_t trace_events_dropped = 0;
+
+static ET_THREAD_LOCAL size_t node_counts[NODE_TAG_COUNT] = { 0 };
+static ET_THREAD_LOCAL size_t peak_live_registers = 0;
+static ET_THREAD_LOCAL size_t spilled_values = 0;
+static ET_THREAD_LOCAL size_t spill_stores = 0;
+static ET_THREAD_LOCAL size_t reloads = 0;
+static ET_THREAD_LOCAL size_t copies = 0;
+
+static uint64_t now_ns(void);
+static void trace_record(stats_phase_t phase, uint64_t start_ns, uint64_t end_ns);
+
+void stats_enable(bool trace) {
+    stats_enabled = true;
+    stats_tracing = trace;
+    stats_epoch_ns = now_ns();
+    phase_last_ns = stats_epoch_ns;
+}
+
+void stats_phase_push(stats_phase_t phase) {
+    if(!stats_enabled) {
+        return;
+    }
+    assert(phase_depth < STATS_MAX_NESTING);
+    uint64_t now = now_ns();
+    if(phase_depth > 0) {
+        phase_ns[phase_stack[phase_depth - 1].phase] += now - phase_last_ns;
+    }
+    phase_stack[phase_depth++] = (stats_frame_t) { .phase = phase, .start_ns = now };
+    phase_last_ns = now;
+    ++phase_entries[phase];
+}
+
+void stats_phase_pop(void) {
+    if(!stats_enabled) {
+        return;
+    }
+    assert(phase_depth > 0);
+    uint64_t now = now_ns();
+    const stats_frame_t *frame = &phase_stack[--phase_depth];
+    phase_ns[frame->phase] += now - phase_last_ns;
+    phase_last_ns = now;
+    if(stats_tracing && frame->phase != STATS_PHASE_LEX) {
+        trace_record(frame->phase, frame->start_ns, now);
+    }
+}
+
+void stats_count_node(parse_node_tag_t tag) {
+    assert((size_t) tag < NODE_TAG_COUNT);
+    ++node_counts[tag];
+}
+
+void stats_note_live_registers(size_t live) {
+    if(live > peak_live_registers) {
+        peak_live_registers = live;
+    }
+}
+
+void stats_count_spilled_value(void) {
+    ++spilled_values;
+}
+
+void stats_count_spill_store(void) {
+    ++spill_stores;
+}
+
+void stats_count_reload(void) {
+    ++reloads;
+}
+
+void stats_count_copy(void) {
+    ++copies;
+}
+
+void stats_report(FILE *out) {
+    uint64_t total_ns = 0;
+    for(size_t phase = 0; phase < STATS_NUM_PHASES; ++phase) {
+        total_ns += phase_ns[phase];
+    }
+    for(size_t phase = 0; phase < STATS_NUM_PHASES; ++phase) {
+        fprintf(out, "phase %-10s %12.3f ms %6.1f%% %10zu entries\n", phase_names[phase], (double) phase_ns[phase] / 1e6,
+                total_ns ? 100.0 * (double) phase_ns[phase] / (double) total_ns : 0.0, phase_entries[phase]);
+    }
+    for(size_t tag = 0; tag < NODE_TAG_COUNT; ++tag) {
+        fprintf(out, "nodes %-10s %12zu\n", node_tag_names[tag], node_counts[tag]);
+    }
+    fprintf(out, "peak live registers %zu\n", peak_live_registers);
+    fprintf(out, "spilled values      %zu\n", spilled_values);
+    fprintf(out, "spill stores        %zu\n", spill_stores);
+    fprintf(out, "reloads             %zu\n", reloads);
+    fprintf(out, "copies              %zu\n", copies);
+}
+
+bool stats_write_trace(const char *path) {
+    FILE *trace = fopen(path, "w");
+    if(trace == NULL) {
+        return false;
+    }
+    fprintf(trace, "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped_events\": %zu}, \"traceEvents\": [\n",
+            trace_events_dropped);
+    for(size_t idx = 0; idx < trace_events_len; ++idx) {
+        const stats_trace_event_t *event = &trace_events[idx];
+        // N.B. trace_event timestamps are in microseconds
+        fprintf(trace, "%s{\"name\": \"%s\", \"cat\": \"et\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, "
+                "\"tid\": 1}\n", idx ? "," : "", phase_names[event->phase],
+                (double) (event->start_ns - stats_epoch_ns) / 1e3, (double) event->duration_ns / 1e3);
+    }
+    fprintf(trace, "]}\n");
+    return fclose(trace) == 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void trace_record(stats_phase_t phase, uint64_t start_ns, uint64_t end_ns) {
+    if(trace_events_len == STATS_MAX_TRACE_EVENTS) {
+        ++trace_events_dropped;
+        return;
+    }
+    if(trace_events_len == trace_events_cap) {
+        size_t new_cap = trace_events_cap ? trace_events_cap * TRACE_EVENTS_GROWTH_FACTOR : INIT_TRACE_EVENTS_LEN;
+        stats_trace_event_t *new_events = realloc(trace_events, new_cap * sizeof(stats_trace_event_t));
+        if(new_events == NULL) {
+            // The trace is only a nice-to-have.
+            ++trace_events_dropped;
+            return;
+        }
+        trace_events = new_events;
+        trace_events_cap = new_cap;
+    }
+    trace_events[trace_events_len++] = (stats_trace_event_t) {
+        .phase = phase,
+        .start_ns = start_ns,
+        .duration_ns = end_ns - start_ns,
+    };
+}
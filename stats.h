@@ -0,0 +1,46 @@
+#pragma once
+
+#include "parse_tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Where the compiler spends its time. Phases nest (everything happens during parsing, say), and each one is only
+// charged for the time it doesn't spend in a nested phase.
+typedef enum {
+    STATS_PHASE_LEX,
+    STATS_PHASE_PARSE,
+    STATS_PHASE_FOLD,
+    STATS_PHASE_LOWER,
+    STATS_PHASE_IR_PASSES,
+    STATS_PHASE_ISEL,
+    STATS_PHASE_REGALLOC,
+    STATS_PHASE_PEEPHOLE,
+    STATS_PHASE_WRITE,
+    // Executing the program (the JIT and the bytecode interpreter)
+    STATS_PHASE_RUN,
+    STATS_NUM_PHASES,
+} stats_phase_t;
+
+// Turns on timing (which costs two clock reads per phase), and with `trace`, recording phases for stats_write_trace().
+void stats_enable(bool trace);
+
+// N.B. Both do nothing unless stats are enabled
+void stats_phase_push(stats_phase_t phase);
+void stats_phase_pop(void);
+
+// Counters are cheap enough to always keep.
+void stats_count_node(parse_node_tag_t tag);
+void stats_note_live_registers(size_t live);
+void stats_count_spilled_value(void);
+void stats_count_spill_store(void);
+void stats_count_reload(void);
+void stats_count_copy(void);
+
+void stats_report(FILE *out);
+
+// A Chrome trace_event file (chrome://tracing, or Perfetto), with one complete event per phase (bar lexing, which is
+// far too fine-grained).
+// N.B. Returns false if the file can't be written
+bool stats_write_trace(const char *path);
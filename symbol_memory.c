@@ -1,41 +1,69 @@
+#include "stats.h"
 #include "symbol_memory.h"
+#include "thread_local.h"
 
 #include <assert.h>
-#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 
-#define INIT_SYMB_TAB_LEN ((size_t) 5)
+#define INIT_SYMB_TAB_LEN ((size_t) 64)
 #define SYMB_TAB_GROWTH_FACTOR ((size_t) 2)
+#define INIT_CLOBBER_LIST_LEN ((size_t) 64)
+#define CLOBBER_LIST_GROWTH_FACTOR ((size_t) 2)
+#define SYMB_FREE_LIST_END UINT32_MAX
+
+#define SYMB_HANDLE(slot, generation) (((symbol_table_index_t) (generation) << 32) | (slot))
+#define SYMB_HANDLE_SLOT(handle) ((uint32_t) (handle))
+#define SYMB_HANDLE_GENERATION(handle) ((uint32_t) ((handle) >> 32))
 
-#define REG_TAB_INVALID_ADDR ((size_t) -1)
 #define REG_TAB_FULL ((size_t) -1)
 
+#define STACK_SLOT_LEN ((size_t) 4)
+#define STACK_FRAME_ALIGN ((size_t) 16)
+#define PUSHED_REGISTER_LEN ((size_t) 8)
+
+// Never handed out by the allocator: it patches up instructions that would otherwise end up with two memory operands.
+#define SPILL_SCRATCH_REGISTER X86_R11
+
+#define REGISTER_BIT(reg) ((uint32_t) 1 << (reg))
+// What a call (i.e. putint, and printf behind it) is allowed to clobber under the SysV ABI.
+#define CALLER_SAVED_REGISTERS (REGISTER_BIT(X86_RAX) | REGISTER_BIT(X86_RCX) | REGISTER_BIT(X86_RDX) | \
+                                REGISTER_BIT(X86_RSI) | REGISTER_BIT(X86_RDI) | REGISTER_BIT(X86_R8) | \
+                                REGISTER_BIT(X86_R9) | REGISTER_BIT(X86_R10) | REGISTER_BIT(X86_R11))
+
 typedef struct {
-    const char *const repr;
+    const x86_register_t reg;
+    const bool callee_saved;
+    // Linear scan state
     bool in_use;
-    symbol_table_index_t symb;
+    vreg_t vreg;
+    // Callee-saved registers that were ever handed out have to be preserved by the prologue/epilogue.
+    bool ever_used;
 } register_entry_t;
 
-// Contains only scratch registers.
-static register_entry_t register_table[] = {
-    {.repr = "%eax", .in_use = false, .symb = REG_TAB_INVALID_ADDR},
-    {.repr = "%ecx", .in_use = false, .symb = REG_TAB_INVALID_ADDR},
-    {.repr = "%edx", .in_use = false, .symb = REG_TAB_INVALID_ADDR},
-    {.repr = "%esi", .in_use = false, .symb = REG_TAB_INVALID_ADDR},
-    {.repr = "%edi", .in_use = false, .symb = REG_TAB_INVALID_ADDR},
+// In order of preference: caller-saved registers come for free, callee-saved ones cost a push and a pop.
+static ET_THREAD_LOCAL register_entry_t register_table[] = {
+    {.reg = X86_RAX, .callee_saved = false},
+    {.reg = X86_RCX, .callee_saved = false},
+    {.reg = X86_RDX, .callee_saved = false},
+    {.reg = X86_RSI, .callee_saved = false},
+    {.reg = X86_RDI, .callee_saved = false},
+    {.reg = X86_R8, .callee_saved = false},
+    {.reg = X86_R9, .callee_saved = false},
+    {.reg = X86_R10, .callee_saved = false},
+    {.reg = X86_RBX, .callee_saved = true},
+    {.reg = X86_R12, .callee_saved = true},
+    {.reg = X86_R13, .callee_saved = true},
+    {.reg = X86_R14, .callee_saved = true},
+    {.reg = X86_R15, .callee_saved = true},
 };
 static const size_t REGISTER_TABLE_LEN = sizeof register_table / sizeof(*register_table);
 
-// XXX: Add memory_something_index_t, but there are caveats:
-//  - globals cannot safely be stacked without significant care
-//  - want to avoid stack fragmentation (e.g. holes from unstacking)
-//  IDEA: use another array similar to register thingy, indexed relative to %rbp, but of adjustable size
-//  IDEA: whenever we alloc in mem, use a tagged union so that all values are the same size + stay relatively alligned
-typedef bool memory_something_index_t;
+// Spilled symbols live in %rbp-relative stack slots. Every slot is the same size, so always handing out the lowest
+// free one keeps the frame as small as possible without ever leaving holes that can't be reused.
+typedef size_t stack_slot_index_t;
 
 typedef enum {
-    // N.B. SYMB_UNUSED *must* be 0 because we calloc() the symbol table!
     SYMB_UNUSED = 0,
     SYMB_REGI,
     SYMB_ADDR,
@@ -43,190 +71,539 @@ typedef enum {
 
 typedef union {
     register_table_index_t regis;
-    memory_something_index_t addr;
+    stack_slot_index_t addr;
 } symbol_location_t;
 
+// N.B. A symbol table entry is only a handle on the virtual register currently behind it. Every symbol_add() starts a
+// new one, so entries can be reused without their live ranges running together. Free entries are threaded onto the
+// free list through the same storage.
+typedef struct {
+    bool in_use;
+    uint32_t generation;
+    union {
+        vreg_t vreg;
+        uint32_t next_free;
+    } u;
+} symbol_entry_t;
+
+// The live range of a virtual register (in instruction indices) and the location it ended up with.
 typedef struct {
+    size_t start;
+    size_t end;
+    size_t num_uses;
     symbol_type_t type;
     symbol_location_t loc;
-} symbol_entry_t;
+    // What the value is a copy of when it's born (another virtual register, or a fixed one like %edx after idivl), or
+    // the fixed register it's copied into when it dies; see preferred_reg_tab_entry().
+    bool copies_vreg;
+    vreg_t copied_vreg;
+    bool copies_reg;
+    x86_register_t copied_reg;
+} vreg_interval_t;
+
+// Where one register gets destroyed, in increasing order of position (so it takes a binary search to find whether
+// that happens inside an interval).
+typedef struct {
+    size_t *positions;
+    size_t len;
+    size_t cap;
+} clobber_list_t;
+
+// A slab: slots [0, symbol_table_len) have been handed out at some point, and the free ones among them form a list
+// starting at symbol_free_head.
+static ET_THREAD_LOCAL symbol_entry_t *symbol_table = NULL;
+static ET_THREAD_LOCAL size_t symbol_table_len = 0;
+static ET_THREAD_LOCAL size_t symbol_table_cap = 0;
+static ET_THREAD_LOCAL uint32_t symbol_free_head = SYMB_FREE_LIST_END;
+static ET_THREAD_LOCAL vreg_t next_vreg = 0;
+
+// For each stack slot, the last instruction at which it holds a value.
+static ET_THREAD_LOCAL size_t *stack_slot_busy_until = NULL;
+static ET_THREAD_LOCAL size_t stack_slot_count = 0;
+
+static uint32_t next_avail_symb_tab_entry(void);
+static symbol_entry_t *symbol_entry(symbol_table_index_t index);
+static vreg_interval_t *compute_intervals(const insn_buffer_t *in, vreg_t **order, size_t *order_len);
+static void note_operand_use(vreg_interval_t *intervals, vreg_t *order, size_t *order_len, const insn_operand_t *operand, size_t position);
+static void note_copies(const insn_buffer_t *in, vreg_interval_t *intervals);
+static void compute_clobbers(const insn_buffer_t *in, clobber_list_t *clobbers);
+static void clobber_list_push(clobber_list_t *list, size_t position);
+static uint32_t clobbered_within(const clobber_list_t *clobbers, const vreg_interval_t *interval);
+static void linear_scan(vreg_interval_t *intervals, const vreg_t *order, size_t order_len, const clobber_list_t *clobbers);
+static register_table_index_t next_avail_reg_tab_entry(uint32_t forbidden);
+static register_table_index_t preferred_reg_tab_entry(const vreg_interval_t *intervals, const vreg_interval_t *current,
+                                                      uint32_t forbidden);
+static double spill_cost(const vreg_interval_t *interval);
+static void spill_interval(vreg_interval_t *interval);
+static stack_slot_index_t stack_slot_alloc(size_t start, size_t end);
+static void rewrite_program(const insn_buffer_t *in, insn_buffer_t *out, const vreg_interval_t *intervals);
+static insn_operand_t rewrite_operand(insn_operand_t operand, const vreg_interval_t *intervals, size_t num_pushed);
+static void rewrite_leal(insn_buffer_t *out, insn_t insn);
+
+symbol_table_index_t symbol_add(void) {
+    uint32_t symb_spot = next_avail_symb_tab_entry();
+    symbol_entry_t *entry = &symbol_table[symb_spot];
+    entry->in_use = true;
+    entry->u.vreg = next_vreg++;
+    return SYMB_HANDLE(symb_spot, entry->generation);
+}
 
-static symbol_entry_t *symbol_table = NULL;
-static size_t symbol_table_len = INIT_SYMB_TAB_LEN;
+void symbol_del(symbol_table_index_t index) {
+    symbol_entry_t *entry = symbol_entry(index);
 
-static symbol_table_index_t next_avail_symb_tab_entry(void);
-static register_table_index_t next_avail_reg_tab_entry(void);
-static bool symbol_request_reg(size_t, const symbol_table_index_t *);
-static bool symbol_demote_to_mem(symbol_table_index_t);
-static bool symbol_promote_to_reg(register_table_index_t, symbol_table_index_t);
+    entry->in_use = false;
+    ++entry->generation;
+    entry->u.next_free = symbol_free_head;
+    symbol_free_head = SYMB_HANDLE_SLOT(index);
+}
 
-symbol_table_index_t symbol_add(void) {
-    if(symbol_table == NULL) {
-        symbol_table = calloc(INIT_SYMB_TAB_LEN, sizeof(symbol_entry_t));
-        // TODO: Compiler error if out of memory!
+insn_operand_t symbol_operand(symbol_table_index_t index) {
+    return insn_vreg(symbol_entry(index)->u.vreg);
+}
+
+void symbol_allocate(const insn_buffer_t *in, insn_buffer_t *out) {
+    vreg_t *order;
+    size_t order_len;
+    vreg_interval_t *intervals = compute_intervals(in, &order, &order_len);
+    clobber_list_t clobbers[X86_NUM_REGISTERS] = { { .positions = NULL, .len = 0, .cap = 0 } };
+    compute_clobbers(in, clobbers);
+
+    linear_scan(intervals, order, order_len, clobbers);
+    rewrite_program(in, out, intervals);
+
+    for(size_t reg = 0; reg < X86_NUM_REGISTERS; ++reg) {
+        free(clobbers[reg].positions);
     }
+    free(order);
+    free(intervals);
+
+    // Every program is allocated on its own (the emitter has deleted all of its symbols by now), so the next one starts
+    // from scratch and comes out the same whatever was compiled on this thread before it.
+    for(register_table_index_t r_idx = 0; r_idx < REGISTER_TABLE_LEN; ++r_idx) {
+        register_table[r_idx].in_use = false;
+        register_table[r_idx].ever_used = false;
+    }
+    next_vreg = 0;
+    stack_slot_count = 0;
+}
 
-    symbol_table_index_t symb_spot = next_avail_symb_tab_entry();
-    register_table_index_t reg_spot = next_avail_reg_tab_entry();
-    if(reg_spot != REG_TAB_FULL) { // Going into register
-        symbol_table[symb_spot].type = SYMB_REGI;
-        symbol_table[symb_spot].loc.regis = reg_spot;
-        register_table[reg_spot].in_use = true;
-        register_table[reg_spot].symb = symb_spot;
+static uint32_t next_avail_symb_tab_entry(void) {
+    // Reuse the most recently freed entry, if any.
+    if(symbol_free_head != SYMB_FREE_LIST_END) {
+        uint32_t index = symbol_free_head;
+        symbol_free_head = symbol_table[index].u.next_free;
+        return index;
     }
-    else { // Going into memory
-        // XXX: Actually do memory fallback here!
-        assert(false);
+
+    // Otherwise take a fresh one off the end of the slab, growing it if need be.
+    if(symbol_table_len == symbol_table_cap) {
+        size_t new_cap = symbol_table_cap ? symbol_table_cap * SYMB_TAB_GROWTH_FACTOR : INIT_SYMB_TAB_LEN;
+        // TODO: Compiler error if too many symbols are live at once
+        assert(new_cap < SYMB_FREE_LIST_END);
+        symbol_entry_t *new_table = realloc(symbol_table, new_cap * sizeof(symbol_entry_t));
+        // TODO: Compiler error if out of memory
+        assert(new_table != NULL);
+        symbol_table = new_table;
+        symbol_table_cap = new_cap;
     }
+    symbol_table[symbol_table_len] = (symbol_entry_t) { .in_use = false, .generation = 0 };
+    return (uint32_t) symbol_table_len++;
+}
 
-    return symb_spot;
+static symbol_entry_t *symbol_entry(symbol_table_index_t index) {
+    assert(SYMB_HANDLE_SLOT(index) < symbol_table_len);
+    symbol_entry_t *entry = &symbol_table[SYMB_HANDLE_SLOT(index)];
+    // A mismatch means the symbol behind this handle has already been deleted (and maybe the slot reused since).
+    assert(entry->in_use && entry->generation == SYMB_HANDLE_GENERATION(index));
+    return entry;
 }
 
-void symbol_del(symbol_table_index_t index) {
-    assert(symbol_table != NULL);
+// The program is straight-line code, so a virtual register is live from its first mention to its last.
+// N.B. `order` receives the virtual registers in order of increasing start, as linear scan wants them.
+static vreg_interval_t *compute_intervals(const insn_buffer_t *in, vreg_t **order, size_t *order_len) {
+    vreg_interval_t *intervals = calloc(next_vreg, sizeof(vreg_interval_t));
+    *order = malloc(next_vreg * sizeof(vreg_t));
+    // TODO: Compiler error if out of memory
+    assert(next_vreg == 0 || (intervals != NULL && *order != NULL));
+    *order_len = 0;
 
-    switch(symbol_table[index].type) {
-        case SYMB_UNUSED: {
-            assert(false);
-            break;
+    for(size_t position = 0; position < in->len; ++position) {
+        note_operand_use(intervals, *order, order_len, &in->insns[position].src, position);
+        note_operand_use(intervals, *order, order_len, &in->insns[position].index, position);
+        note_operand_use(intervals, *order, order_len, &in->insns[position].dst, position);
+    }
+    note_copies(in, intervals);
+    return intervals;
+}
+
+static void note_operand_use(vreg_interval_t *intervals, vreg_t *order, size_t *order_len, const insn_operand_t *operand, size_t position) {
+    if(operand->kind != OPND_VREG) {
+        return;
+    }
+    vreg_interval_t *interval = &intervals[operand->u.vreg];
+    if(interval->num_uses == 0) {
+        interval->start = position;
+        order[(*order_len)++] = operand->u.vreg;
+    }
+    interval->end = position;
+    ++interval->num_uses;
+}
+
+// Values are never written in place by whoever reads them: anything that would be (the left operand of addl, say) has
+// been copied into a value of its own first. That copy is only really needed while the original lives on. Where the
+// original dies right at the copy, or the copy is of (or into) a fixed register, both may as well share a register;
+// which the copy remembers here, so that linear scan can try that register first and the copy becomes a self-move.
+static void note_copies(const insn_buffer_t *in, vreg_interval_t *intervals) {
+    for(size_t position = 0; position < in->len; ++position) {
+        const insn_t *insn = &in->insns[position];
+        if(insn->opcode != INSN_MOVL) {
+            continue;
         }
-        case SYMB_REGI: {
-            register_table_index_t r_idx = symbol_table[index].loc.regis;
-            register_table[r_idx].in_use = false;
-            register_table[r_idx].symb = REG_TAB_INVALID_ADDR;
-            break;
+        if(insn->dst.kind == OPND_VREG && intervals[insn->dst.u.vreg].start == position) {
+            vreg_interval_t *copy = &intervals[insn->dst.u.vreg];
+            if(insn->src.kind == OPND_VREG && intervals[insn->src.u.vreg].end == position) {
+                copy->copies_vreg = true;
+                copy->copied_vreg = insn->src.u.vreg;
+            }
+            else if(insn->src.kind == OPND_REG) {
+                copy->copies_reg = true;
+                copy->copied_reg = insn->src.u.reg;
+            }
         }
-        case SYMB_ADDR: {
-            // XXX: Actually handle memory!
-            assert(false);
-            break;
+        if(insn->src.kind == OPND_VREG && insn->dst.kind == OPND_REG && intervals[insn->src.u.vreg].end == position &&
+           !intervals[insn->src.u.vreg].copies_reg) {
+            intervals[insn->src.u.vreg].copies_reg = true;
+            intervals[insn->src.u.vreg].copied_reg = insn->dst.u.reg;
         }
     }
-
-    symbol_table[index].type = SYMB_UNUSED;
 }
 
-bool symbol_give_me_my_stuff(size_t num_symbols, const char **out_registers, symbol_table_index_t symbol0, ...) {
-    symbol_table_index_t symbols[num_symbols];
-    va_list list;
-    va_start(list, symbol0);
-    symbols[0] = symbol0;
-    for(unsigned idx = 1; idx < num_symbols; ++idx) {
-        symbols[idx] = va_arg(list, symbol_table_index_t);
+// Calls clobber every caller-saved register, cltd, idivl and one-operand imull clobber what they implicitly write,
+// and an instruction writing a fixed register clobbers that one.
+static void compute_clobbers(const insn_buffer_t *in, clobber_list_t *clobbers) {
+    for(size_t position = 0; position < in->len; ++position) {
+        const insn_t *insn = &in->insns[position];
+        uint32_t registers = 0;
+        if(insn->opcode == INSN_CALL) {
+            registers = CALLER_SAVED_REGISTERS;
+        }
+        else if(insn->opcode == INSN_CLTD) {
+            registers = REGISTER_BIT(X86_RDX);
+        }
+        else if(insn->opcode == INSN_IMULL_WIDE || insn->opcode == INSN_IDIVL) {
+            registers = REGISTER_BIT(X86_RAX) | REGISTER_BIT(X86_RDX);
+        }
+        else if(insn_writes_dst(insn) && insn->dst.kind == OPND_REG) {
+            registers = REGISTER_BIT(insn->dst.u.reg);
+        }
+        for(size_t reg = 0; reg < X86_NUM_REGISTERS; ++reg) {
+            if(registers & REGISTER_BIT(reg)) {
+                clobber_list_push(&clobbers[reg], position);
+            }
+        }
     }
-    va_end(list);
+}
 
-    if(!symbol_request_reg(num_symbols, symbols)) {
-        return false;
+static void clobber_list_push(clobber_list_t *list, size_t position) {
+    if(list->len == list->cap) {
+        list->cap = list->cap ? list->cap * CLOBBER_LIST_GROWTH_FACTOR : INIT_CLOBBER_LIST_LEN;
+        list->positions = realloc(list->positions, list->cap * sizeof(*list->positions));
+        // TODO: Compiler error if out of memory
+        assert(list->positions != NULL);
     }
-    for(unsigned idx = 0; idx < num_symbols; ++idx) {
-        assert(symbol_table[symbols[idx]].type == SYMB_REGI);
-        out_registers[idx] = register_table[symbol_table[symbols[idx]].loc.regis].repr;
+    list->positions[list->len++] = position;
+}
+
+// The registers a value can't live in because something destroys them while it is live. The value's own first and
+// last instructions don't count: it is either written after the clobber or read before it.
+static uint32_t clobbered_within(const clobber_list_t *clobbers, const vreg_interval_t *interval) {
+    uint32_t registers = 0;
+    for(size_t reg = 0; reg < X86_NUM_REGISTERS; ++reg) {
+        // The first clobber after the start, if any
+        const clobber_list_t *list = &clobbers[reg];
+        size_t lo = 0;
+        size_t hi = list->len;
+        while(lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if(list->positions[mid] <= interval->start) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        if(lo < list->len && list->positions[lo] < interval->end) {
+            registers |= REGISTER_BIT(reg);
+        }
     }
-    return true;
+    return registers;
 }
 
-static symbol_table_index_t next_avail_symb_tab_entry(void) {
-    assert(symbol_table != NULL);
+// Poletto & Sarkar's linear scan. When no register is free, whichever of the active intervals (or the new one) has the
+// lowest spill cost goes to the stack for its whole lifetime.
+static void linear_scan(vreg_interval_t *intervals, const vreg_t *order, size_t order_len, const clobber_list_t *clobbers) {
+    for(size_t idx = 0; idx < order_len; ++idx) {
+        vreg_t vreg = order[idx];
+        vreg_interval_t *current = &intervals[vreg];
+
+        // Expire everything that died before this one is born. Instructions read their operands before writing, so a
+        // value that dies in the very instruction that defines this one can hand over its register (which turns a copy
+        // into a self-move for the peephole optimizer to delete).
+        for(register_table_index_t r_idx = 0; r_idx < REGISTER_TABLE_LEN; ++r_idx) {
+            const vreg_interval_t *other = register_table[r_idx].in_use ? &intervals[register_table[r_idx].vreg] : NULL;
+            if(other != NULL && (other->end < current->start ||
+                                 (other->end == current->start && other->start < current->start))) {
+                register_table[r_idx].in_use = false;
+            }
+        }
 
-    // Look for an existing unused symbol table entry.
-    for(symbol_table_index_t index = 0; index < symbol_table_len; ++index) {
-        if(symbol_table[index].type == SYMB_UNUSED) {
-            return index;
+        uint32_t forbidden = clobbered_within(clobbers, current);
+        register_table_index_t r_idx = preferred_reg_tab_entry(intervals, current, forbidden);
+        if(r_idx == REG_TAB_FULL) {
+            r_idx = next_avail_reg_tab_entry(forbidden);
         }
-    }
+        if(r_idx == REG_TAB_FULL) {
+            // Find the cheapest value to kick out of a register we're allowed to use.
+            register_table_index_t victim = REG_TAB_FULL;
+            for(register_table_index_t other = 0; other < REGISTER_TABLE_LEN; ++other) {
+                if(!register_table[other].in_use || (forbidden & REGISTER_BIT(register_table[other].reg))) {
+                    continue;
+                }
+                if(victim == REG_TAB_FULL ||
+                   spill_cost(&intervals[register_table[other].vreg]) < spill_cost(&intervals[register_table[victim].vreg])) {
+                    victim = other;
+                }
+            }
 
-    // Couldn't find any available entries, so grow the table.
-    size_t old_len = symbol_table_len;
-    symbol_table_len *= SYMB_TAB_GROWTH_FACTOR;
-    realloc(symbol_table, symbol_table_len * sizeof(*symbol_table));
-    // TODO: Compiler error if out of memory
-    memset(symbol_table + old_len, 0, (symbol_table_len - old_len) * sizeof(*symbol_table));
-    return old_len;
+            if(victim == REG_TAB_FULL || spill_cost(current) <= spill_cost(&intervals[register_table[victim].vreg])) {
+                spill_interval(current);
+                continue;
+            }
+            spill_interval(&intervals[register_table[victim].vreg]);
+            r_idx = victim;
+        }
+
+        current->type = SYMB_REGI;
+        current->loc.regis = r_idx;
+        register_table[r_idx].in_use = true;
+        register_table[r_idx].vreg = vreg;
+        register_table[r_idx].ever_used = true;
+
+        size_t live = 0;
+        for(register_table_index_t other = 0; other < REGISTER_TABLE_LEN; ++other) {
+            live += register_table[other].in_use;
+        }
+        stats_note_live_registers(live);
+    }
 }
 
 // N.B. Returns REG_TAB_FULL on (non-fatal) failure
-static register_table_index_t next_avail_reg_tab_entry(void) {
+static register_table_index_t next_avail_reg_tab_entry(uint32_t forbidden) {
     for(register_table_index_t index = 0; index < REGISTER_TABLE_LEN; ++index) {
-        if(!register_table[index].in_use) {
+        if(!register_table[index].in_use && !(forbidden & REGISTER_BIT(register_table[index].reg))) {
             return index;
         }
     }
     return REG_TAB_FULL;
 }
 
-static bool symbol_request_reg(size_t num_requested, const symbol_table_index_t *symbols) {
-    // For each of the requested symbols
-    for(unsigned index = 0; index < num_requested; ++index) {
-        // If not already stored in a register
-        if(symbol_table[symbols[index]].type != SYMB_REGI) {
-            bool successfully_promoted = false;
-
-            // Call next_avail_reg_tab_entry()
-            register_table_index_t r_idx = next_avail_reg_tab_entry();
-            if(r_idx == REG_TAB_FULL) {
-                // For each used register table location (i.e. all of them)
-                for(unsigned other_r_idx = 0; other_r_idx < REGISTER_TABLE_LEN; ++other_r_idx) {
-                    unsigned potentially_conflicting;
-                    for(potentially_conflicting = 0; potentially_conflicting < num_requested; ++potentially_conflicting) {
-                        if(register_table[other_r_idx].symb == symbols[potentially_conflicting]) {
-                            // The client also requested the symbol stored in this register. Skip further checks and try a different (destination) register.
-                            break;
-                        }
-                    }
-                    // We made it all the way through, so this one is safe to swap out!
-                    if(potentially_conflicting == num_requested) {
-                        bool safe_and_sound = symbol_demote_to_mem(register_table[other_r_idx].symb);
-                        // TODO: More graceful user-facing error here
-                        assert(safe_and_sound);
-
-                        // Use this newly-freed location
-                        safe_and_sound = symbol_promote_to_reg(other_r_idx, symbols[index]);
-                        // TODO: More graceful user-facing error here
-                        assert(safe_and_sound);
-                        successfully_promoted = true;
-                        break;
-                    }
-                }
-            }
-            else { // register_table is not full: place in empty space
-                bool safe_and_sound = symbol_promote_to_reg(r_idx, symbols[index]);
-                // TODO: More graceful user-facing error here
-                assert(safe_and_sound);
-                successfully_promoted = true;
-            }
+// The register the value shares with what it's a copy of (see note_copies()), if that one is free for it
+// N.B. Returns REG_TAB_FULL otherwise
+static register_table_index_t preferred_reg_tab_entry(const vreg_interval_t *intervals, const vreg_interval_t *current,
+                                                      uint32_t forbidden) {
+    x86_register_t reg;
+    if(current->copies_vreg && intervals[current->copied_vreg].type == SYMB_REGI) {
+        reg = register_table[intervals[current->copied_vreg].loc.regis].reg;
+    }
+    else if(current->copies_reg) {
+        reg = current->copied_reg;
+    }
+    else {
+        return REG_TAB_FULL;
+    }
+    for(register_table_index_t index = 0; index < REGISTER_TABLE_LEN; ++index) {
+        if(register_table[index].reg == reg) {
+            bool usable = !register_table[index].in_use && !(forbidden & REGISTER_BIT(reg));
+            return usable ? index : REG_TAB_FULL;
+        }
+    }
+    return REG_TAB_FULL;
+}
+
+// Values that are used rarely over a long stretch are the cheapest to keep on the stack.
+static double spill_cost(const vreg_interval_t *interval) {
+    return (double) interval->num_uses / (double) (interval->end - interval->start + 1);
+}
+
+static void spill_interval(vreg_interval_t *interval) {
+    stats_count_spilled_value();
+    interval->type = SYMB_ADDR;
+    interval->loc.addr = stack_slot_alloc(interval->start, interval->end);
+}
 
-            if(!successfully_promoted) {
-                // We were unable to promote one of the missing values!
-                return false;
+// Hands out the lowest slot that is free for the whole of [start, end]. A spill victim's range began before the
+// current position, so it isn't enough for a slot to be free right now.
+static stack_slot_index_t stack_slot_alloc(size_t start, size_t end) {
+    stack_slot_index_t slot;
+    for(slot = 0; slot < stack_slot_count; ++slot) {
+        if(stack_slot_busy_until[slot] < start) {
+            break;
+        }
+    }
+    if(slot == stack_slot_count) {
+        ++stack_slot_count;
+        stack_slot_busy_until = realloc(stack_slot_busy_until, stack_slot_count * sizeof(*stack_slot_busy_until));
+        // TODO: Compiler error if out of memory
+        assert(stack_slot_busy_until != NULL);
+    }
+    stack_slot_busy_until[slot] = end;
+    return slot;
+}
+
+static void rewrite_program(const insn_buffer_t *in, insn_buffer_t *out, const vreg_interval_t *intervals) {
+    // Prologue: callee-saved registers sit right below the saved %rbp, then come the stack slots.
+    size_t num_pushed = 0;
+    for(register_table_index_t r_idx = 0; r_idx < REGISTER_TABLE_LEN; ++r_idx) {
+        if(register_table[r_idx].callee_saved && register_table[r_idx].ever_used) {
+            ++num_pushed;
+        }
+    }
+    // Memory operands are %rbp-relative, including any the program came with (like the JIT's variable slots).
+    bool need_frame = num_pushed > 0 || stack_slot_count > 0;
+    for(size_t position = 0; position < in->len && !need_frame; ++position) {
+        need_frame = in->insns[position].src.kind == OPND_MEM || in->insns[position].dst.kind == OPND_MEM;
+    }
+    size_t pushed_len = num_pushed * PUSHED_REGISTER_LEN;
+    size_t frame_len = pushed_len + stack_slot_count * STACK_SLOT_LEN;
+    frame_len = (frame_len + STACK_FRAME_ALIGN - 1) & ~(STACK_FRAME_ALIGN - 1);
+
+    if(need_frame) {
+        insn_append(out, (insn_t) { .opcode = INSN_PUSHQ, .src = insn_reg(X86_RBP) });
+        insn_append(out, (insn_t) { .opcode = INSN_MOVQ, .src = insn_reg(X86_RSP), .dst = insn_reg(X86_RBP) });
+        for(register_table_index_t r_idx = 0; r_idx < REGISTER_TABLE_LEN; ++r_idx) {
+            if(register_table[r_idx].callee_saved && register_table[r_idx].ever_used) {
+                insn_append(out, (insn_t) { .opcode = INSN_PUSHQ, .src = insn_reg(register_table[r_idx].reg) });
             }
         }
+        if(frame_len > pushed_len) {
+            insn_append(out, (insn_t) { .opcode = INSN_SUBQ, .src = insn_imm((int32_t) (frame_len - pushed_len)), .dst = insn_reg(X86_RSP) });
+        }
     }
 
-    // Sanity-check!
-#ifndef NDEBUG
-    for(unsigned index = 0; index < num_requested; ++index) {
-        // If not already stored in a register
-        if(symbol_table[symbols[index]].type != SYMB_REGI) {
-            // We should have fixed this already!
-            assert(false);
+    for(size_t position = 0; position < in->len; ++position) {
+        insn_t insn = in->insns[position];
+        if(insn.src.kind == OPND_VREG && intervals[insn.src.u.vreg].type == SYMB_ADDR) {
+            stats_count_reload();
+        }
+        if(insn.index.kind == OPND_VREG && intervals[insn.index.u.vreg].type == SYMB_ADDR) {
+            stats_count_reload();
+        }
+        if(insn.dst.kind == OPND_VREG && intervals[insn.dst.u.vreg].type == SYMB_ADDR) {
+            // Two-address instructions (and cmpl) read their destination too.
+            if(insn.opcode == INSN_ADDL || insn.opcode == INSN_SUBL || insn.opcode == INSN_CMPL ||
+               insn.opcode == INSN_INCL || insn.opcode == INSN_DECL || insn.opcode == INSN_NEGL ||
+               insn.opcode == INSN_IMULL || insn.opcode == INSN_SALL || insn.opcode == INSN_SARL ||
+               insn.opcode == INSN_SHRL) {
+                stats_count_reload();
+            }
+            if(insn_writes_dst(&insn)) {
+                stats_count_spill_store();
+            }
         }
+        insn.src = rewrite_operand(insn.src, intervals, num_pushed);
+        insn.dst = rewrite_operand(insn.dst, intervals, num_pushed);
+        insn.index = rewrite_operand(insn.index, intervals, num_pushed);
+        if(insn.opcode == INSN_LEAL) {
+            rewrite_leal(out, insn);
+            continue;
+        }
+        if(insn.opcode == INSN_IMULL && insn.dst.kind == OPND_MEM) {
+            // Neither can two-operand imull, which reads it as well
+            insn_operand_t dst = insn.dst;
+            insn.dst = insn_reg(SPILL_SCRATCH_REGISTER);
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = dst, .dst = insn.dst });
+            insn_append(out, insn);
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = insn.dst, .dst = dst });
+            continue;
+        }
+        if(insn.opcode == INSN_MOVZBL && insn.dst.kind == OPND_MEM) {
+            // movzbl can only write a register
+            insn_operand_t dst = insn.dst;
+            insn.dst = insn_reg(SPILL_SCRATCH_REGISTER);
+            insn_append(out, insn);
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = insn.dst, .dst = dst });
+            continue;
+        }
+        if(insn.src.kind == OPND_MEM && insn.dst.kind == OPND_MEM) {
+            // x86 takes at most one memory operand, so go through the scratch register.
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = insn.src, .dst = insn_reg(SPILL_SCRATCH_REGISTER) });
+            insn.src = insn_reg(SPILL_SCRATCH_REGISTER);
+        }
+        insn_append(out, insn);
     }
-#endif
 
-    // All requested values were either already in registers or promoted successfully.
-    return true;
+    if(need_frame) {
+        if(num_pushed == 0) {
+            insn_append(out, (insn_t) { .opcode = INSN_LEAVE });
+        }
+        else {
+            insn_append(out, (insn_t) { .opcode = INSN_LEAQ, .src = insn_mem(-(int32_t) pushed_len), .dst = insn_reg(X86_RSP) });
+            for(register_table_index_t r_idx = REGISTER_TABLE_LEN; r_idx-- > 0;) {
+                if(register_table[r_idx].callee_saved && register_table[r_idx].ever_used) {
+                    insn_append(out, (insn_t) { .opcode = INSN_POPQ, .src = insn_reg(register_table[r_idx].reg) });
+                }
+            }
+            insn_append(out, (insn_t) { .opcode = INSN_POPQ, .src = insn_reg(X86_RBP) });
+        }
+    }
 }
 
-static bool symbol_demote_to_mem(symbol_table_index_t index) {
-    // XXX: Actually do memory stuff!
-    return false;
+static insn_operand_t rewrite_operand(insn_operand_t operand, const vreg_interval_t *intervals, size_t num_pushed) {
+    if(operand.kind != OPND_VREG) {
+        return operand;
+    }
+    const vreg_interval_t *interval = &intervals[operand.u.vreg];
+    switch(interval->type) {
+        case SYMB_REGI:
+            return insn_reg(register_table[interval->loc.regis].reg);
+        case SYMB_ADDR: {
+            size_t offset = num_pushed * PUSHED_REGISTER_LEN + (interval->loc.addr + 1) * STACK_SLOT_LEN;
+            return insn_mem(-(int32_t) offset);
+        }
+        default:
+            assert(false);
+            return operand;
+    }
 }
 
-// N.B. It is an error to promote into a nonfree register ("...not to mention immoral" -- RMS)
-static bool symbol_promote_to_reg(register_table_index_t dest, symbol_table_index_t benefactor) {
-    assert(!register_table[dest].in_use);
-
-    // XXX: Actually do memory stuff!
-    return false;
+// An address can only be made of registers. With part of it spilled, add it up in the scratch register instead; the
+// flags that clobbers are never live across an address computation.
+static void rewrite_leal(insn_buffer_t *out, insn_t insn) {
+    insn_operand_t dst = insn.dst;
+    insn_operand_t scratch = insn_reg(SPILL_SCRATCH_REGISTER);
+    if(insn.src.kind == OPND_MEM || insn.index.kind == OPND_MEM) {
+        if(insn.index.kind != OPND_NONE) {
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = insn.index, .dst = scratch });
+            if(insn.index_shift != 0) {
+                insn_append(out, (insn_t) { .opcode = INSN_SALL, .src = insn_imm(insn.index_shift), .dst = scratch });
+            }
+            insn_append(out, (insn_t) { .opcode = INSN_ADDL, .src = insn.src, .dst = scratch });
+        }
+        else {
+            insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = insn.src, .dst = scratch });
+        }
+        if(insn.disp != 0) {
+            insn_append(out, (insn_t) { .opcode = INSN_ADDL, .src = insn_imm(insn.disp), .dst = scratch });
+        }
+    }
+    else if(dst.kind == OPND_MEM) {
+        // lea can only write a register
+        insn.dst = scratch;
+        insn_append(out, insn);
+    }
+    else {
+        insn_append(out, insn);
+        return;
+    }
+    insn_append(out, (insn_t) { .opcode = INSN_MOVL, .src = scratch, .dst = dst });
 }
@@ -1,14 +1,26 @@
 #pragma once
 
+#include "insn_buffer.h"
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-typedef size_t symbol_table_index_t;
+// A handle on a symbol table slot: the slot's index in the low half, and its generation (bumped every time the slot is
+// freed) in the high half, so that debug builds catch a handle that outlived its symbol.
+typedef uint64_t symbol_table_index_t;
 typedef size_t register_table_index_t;
 
+// Each symbol is a fresh virtual register, which only gets a real location from symbol_allocate().
 symbol_table_index_t symbol_add(void);
 
 // N.B. Illegal to delete unused location!
 void symbol_del(symbol_table_index_t);
 
-bool symbol_give_me_my_stuff(size_t num_symbols, const char **out_registers, symbol_table_index_t symbol0, ...);
+// The operand to put in an instruction to refer to the symbol.
+insn_operand_t symbol_operand(symbol_table_index_t);
+
+// Computes the live range of every symbol used in `in` and assigns registers to them by linear scan, spilling the
+// cheapest ones to the stack when they run out. `out` receives the rewritten program, complete with prologue and
+// epilogue.
+void symbol_allocate(const insn_buffer_t *in, insn_buffer_t *out);
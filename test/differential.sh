@@ -0,0 +1,46 @@
+#!/bin/sh
+# Runs generated programs (see bench/gen.c) through the compiled backends and checks them against the bytecode VM, which
+# skips the optimizer entirely: -f jit has to print the same value for every line, and -f exe the same last value. Each
+# program is tried at -O0, -O1, and -O1 --no-fold (which leaves the constants for the IR passes to reduce). Names every
+# program that differs, and exits nonzero if there were any.
+#
+# USAGE: differential.sh <et> <gen> [programs] [lines]
+
+et="$1"
+gen="$2"
+programs="${3:-20}"
+lines="${4:-200}"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+failures=0
+for profile in deep wide compare const
+do
+    seed=1
+    while [ "$seed" -le "$programs" ]
+    do
+        "$gen" "$profile" "$seed" "$lines" >"$tmp/prog.et"
+        "$et" -f vm <"$tmp/prog.et" >"$tmp/expected"
+        tail -n 1 "$tmp/expected" >"$tmp/expected_last"
+
+        for opts in "-O0" "-O1" "-O1 --no-fold"
+        do
+            # N.B. $opts is split into words on purpose
+            if ! "$et" $opts -f jit <"$tmp/prog.et" >"$tmp/jit" || ! cmp -s "$tmp/expected" "$tmp/jit"
+            then
+                echo "$profile $seed $opts: -f jit differs from -f vm"
+                failures=$((failures + 1))
+            fi
+            if ! "$et" $opts -f exe -o "$tmp/prog" <"$tmp/prog.et" || ! "$tmp/prog" >"$tmp/exe" ||
+               ! cmp -s "$tmp/expected_last" "$tmp/exe"
+            then
+                echo "$profile $seed $opts: -f exe differs from -f vm"
+                failures=$((failures + 1))
+            fi
+        done
+        seed=$((seed + 1))
+    done
+done
+
+[ "$failures" -eq 0 ]
@@ -0,0 +1,5 @@
+#pragma once
+
+// Compiler state lives in each module's file-scope variables, one copy per thread: a thread's copies are its compiler
+// context. That way batch_run() can compile a unit on every core without any locking (see batch.h).
+#define ET_THREAD_LOCAL __thread
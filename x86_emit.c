@@ -0,0 +1,648 @@
+#include "x86_emit.h"
+#include "elf_writer.h"
+#include "insn_buffer.h"
+#include "jit.h"
+#include "output.h"
+#include "peephole.h"
+#include "stats.h"
+#include "symbol_memory.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// How an IR_BINARY addition, subtraction, multiplication or shift gets covered: the pattern, and the operands the
+// code it emits reads.
+typedef struct isel_pattern isel_pattern_t;
+typedef struct {
+    const isel_pattern_t *pattern;
+    int cost;
+    parse_node_operator_t operr;
+    ir_operand_t a;
+    // For the lea patterns, the index if it is a value
+    ir_operand_t b;
+    // What lea adds to the address, or what inc/dec add
+    int32_t disp;
+    // What lea scales the index by, as a shift count
+    uint8_t index_shift;
+    // A single-use addition or shift whose code is folded into this instruction's lea, if any
+    ir_value_t fused;
+    // Covered by its only user instead, so it emits nothing
+    bool skip;
+} isel_cover_t;
+
+// Where each IR value lives while it is being emitted: a symbol from its definition until its last use.
+typedef struct {
+    const ir_program_t *program;
+    symbol_table_index_t *symbols;
+    size_t *last_use;
+    uint32_t *num_uses;
+    size_t *def_position;
+    isel_cover_t *covers;
+    insn_buffer_t insns;
+} x86_emitter_t;
+
+// Instruction selection tries every pattern that can cover an arithmetic instruction and keeps the cheapest. The cost
+// is an estimate of the encoded size in bytes (REX prefixes aside), where copying a value that dies in the same
+// instruction is free: the allocator hands its register over and the copy becomes a self-move for the peephole
+// optimizer. A fused pattern is credited with the cost of the instruction it swallows.
+// N.B. `match` returns ISEL_NO_MATCH if the pattern doesn't apply, and fills in the cover otherwise
+struct isel_pattern {
+    const char *name;
+    int (*match)(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+    void (*emit)(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst);
+};
+
+#define NEVER_USED ((size_t) -1)
+#define ISEL_NO_MATCH INT_MAX
+
+// movl $imm, %r; movl %r, %r; incl/decl/negl %r
+#define MOVL_IMM_COST 5
+#define MOVL_REG_COST 2
+#define UNARY_COST 2
+
+static void select_insns(x86_emitter_t *emitter);
+static int match_two_address(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_two_address_swapped(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_inc_dec(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_neg(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_lea(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_lea_fused(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static int match_lea_scaled(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover);
+static const ir_insn_t *fusable(const x86_emitter_t *emitter, ir_operand_t ir_operand);
+static bool split_addend(const ir_insn_t *insn, ir_operand_t *value, int32_t *addend);
+static int copy_cost(const x86_emitter_t *emitter, size_t position, ir_operand_t copied, ir_operand_t other);
+static int alu_cost(ir_operand_t src);
+static int lea_cost(bool has_index, int32_t disp);
+static void emit_two_address(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst);
+static void emit_inc_dec(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst);
+static void emit_neg(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst);
+static void emit_lea(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst);
+static void emit_insn(x86_emitter_t *emitter, size_t position, const ir_insn_t *insn);
+static void emit_binary(x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, insn_operand_t dst);
+static void emit_compare(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst);
+static void emit_divide(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst);
+static void emit_multiply_high(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst);
+static bool op_has_patterns(parse_node_operator_t operr);
+static bool op_is_shift(parse_node_operator_t operr);
+static insn_operand_t operand(const x86_emitter_t *emitter, ir_operand_t ir_operand);
+static void release_operand(const x86_emitter_t *emitter, ir_operand_t ir_operand, size_t position);
+static void emit(x86_emitter_t *emitter, insn_opcode_t opcode, insn_operand_t src, insn_operand_t dst);
+static void emit_setcc(x86_emitter_t *emitter, insn_cond_t cond, insn_operand_t dst);
+static insn_opcode_t op_to_opcode(parse_node_operator_t operr);
+static insn_cond_t op_to_cond(parse_node_operator_t operr);
+static insn_cond_t cond_swap(insn_cond_t cond);
+static bool program_may_trap(const insn_buffer_t *program);
+
+// Ties go to whichever comes first.
+static const isel_pattern_t isel_patterns[] = {
+    { .name = "two-address", .match = match_two_address, .emit = emit_two_address },
+    { .name = "two-address-swapped", .match = match_two_address_swapped, .emit = emit_two_address },
+    { .name = "inc-dec", .match = match_inc_dec, .emit = emit_inc_dec },
+    { .name = "neg", .match = match_neg, .emit = emit_neg },
+    { .name = "lea", .match = match_lea, .emit = emit_lea },
+    { .name = "lea-fused", .match = match_lea_fused, .emit = emit_lea },
+    { .name = "lea-scaled", .match = match_lea_scaled, .emit = emit_lea },
+};
+#define ISEL_PATTERNS_LEN (sizeof isel_patterns / sizeof(*isel_patterns))
+
+void x86_emit_program(const ir_program_t *program, const x86_emit_options_t *options) {
+    x86_emitter_t emitter = { .program = program, .insns = INSN_BUFFER_INIT };
+    emitter.symbols = malloc(program->num_values * sizeof(symbol_table_index_t));
+    emitter.last_use = malloc(program->num_values * sizeof(size_t));
+    emitter.num_uses = calloc(program->num_values, sizeof(uint32_t));
+    emitter.def_position = malloc(program->num_values * sizeof(size_t));
+    emitter.covers = malloc(program->len * sizeof(isel_cover_t));
+    // TODO: Compiler error if out of memory
+    assert(program->num_values == 0 || (emitter.symbols != NULL && emitter.last_use != NULL &&
+                                        emitter.num_uses != NULL && emitter.def_position != NULL));
+    assert(program->len == 0 || emitter.covers != NULL);
+
+    for(ir_value_t value = 0; value < program->num_values; ++value) {
+        emitter.last_use[value] = NEVER_USED;
+        emitter.def_position[value] = NEVER_USED;
+    }
+    for(size_t position = 0; position < program->len; ++position) {
+        const ir_insn_t *insn = &program->insns[position];
+        if(ir_defines_value(insn)) {
+            emitter.def_position[insn->dst] = position;
+        }
+        if(insn->a.is_value) {
+            emitter.last_use[insn->a.u.value] = position;
+            ++emitter.num_uses[insn->a.u.value];
+        }
+        if(insn->opcode == IR_BINARY && insn->b.is_value) {
+            emitter.last_use[insn->b.u.value] = position;
+            ++emitter.num_uses[insn->b.u.value];
+        }
+    }
+
+    stats_phase_push(STATS_PHASE_ISEL);
+    select_insns(&emitter);
+    for(size_t position = 0; position < program->len; ++position) {
+        emit_insn(&emitter, position, &program->insns[position]);
+    }
+    stats_phase_pop();
+
+    insn_buffer_t allocated = INSN_BUFFER_INIT;
+    stats_phase_push(STATS_PHASE_REGALLOC);
+    symbol_allocate(&emitter.insns, &allocated);
+    stats_phase_pop();
+    stats_phase_push(STATS_PHASE_PEEPHOLE);
+    peephole_optimize(&allocated, options->peephole_window, options->report);
+    stats_phase_pop();
+    for(size_t idx = 0; idx < allocated.len; ++idx) {
+        if(allocated.insns[idx].opcode == INSN_MOVL && allocated.insns[idx].src.kind == OPND_REG &&
+           allocated.insns[idx].dst.kind == OPND_REG) {
+            stats_count_copy();
+        }
+    }
+
+    stats_phase_push(options->format == X86_OUTPUT_JIT ? STATS_PHASE_RUN : STATS_PHASE_WRITE);
+    switch(options->format) {
+        case X86_OUTPUT_ASM:
+            insn_buffer_print(&allocated);
+            break;
+        case X86_OUTPUT_OBJECT:
+            elf_write_object(&allocated);
+            break;
+        case X86_OUTPUT_EXECUTABLE:
+            elf_write_executable(&allocated);
+            break;
+        case X86_OUTPUT_JIT:
+            // A trap kills the process, so whatever the lines before this one printed has to be out already.
+            if(program_may_trap(&allocated)) {
+                output_flush();
+            }
+            // Just like the putint footer would
+            output_int(jit_run(&allocated));
+            output_char('\n');
+            if(options->interactive) {
+                output_flush();
+            }
+            break;
+    }
+    stats_phase_pop();
+
+    free(allocated.insns);
+    free(emitter.insns.insns);
+    free(emitter.covers);
+    free(emitter.def_position);
+    free(emitter.num_uses);
+    free(emitter.last_use);
+    free(emitter.symbols);
+}
+
+static void emit_insn(x86_emitter_t *emitter, size_t position, const ir_insn_t *insn) {
+    if(insn->opcode == IR_BINARY && emitter->covers[position].skip) {
+        return;
+    }
+    insn_operand_t dst = insn_none();
+    if(ir_defines_value(insn)) {
+        emitter->symbols[insn->dst] = symbol_add();
+        dst = symbol_operand(emitter->symbols[insn->dst]);
+    }
+
+    switch(insn->opcode) {
+        case IR_NOP:
+            break;
+        case IR_MOV:
+            emit(emitter, INSN_MOVL, operand(emitter, insn->a), dst);
+            break;
+        case IR_BINARY:
+            emit_binary(emitter, position, insn, dst);
+            break;
+        case IR_RETURN:
+            emit(emitter, INSN_MOVL, operand(emitter, insn->a), insn_reg(X86_RAX));
+            break;
+        case IR_LOAD:
+            emit(emitter, INSN_MOVL, insn_mem(X86_VARIABLE_SLOT_OFFSET(insn->slot)), dst);
+            break;
+        case IR_STORE:
+            emit(emitter, INSN_MOVL, operand(emitter, insn->a), insn_mem(X86_VARIABLE_SLOT_OFFSET(insn->slot)));
+            break;
+        default:
+            assert(false);
+            break;
+    }
+
+    // Binaries release whatever their cover ended up reading.
+    ir_operand_t a = (insn->opcode == IR_BINARY) ? emitter->covers[position].a : insn->a;
+    ir_operand_t b = (insn->opcode == IR_BINARY) ? emitter->covers[position].b : insn->b;
+    release_operand(emitter, a, position);
+    bool b_is_a = a.is_value && b.is_value && a.u.value == b.u.value;
+    if(insn->opcode == IR_BINARY && !b_is_a) {
+        release_operand(emitter, b, position);
+    }
+    if(ir_defines_value(insn) && emitter->last_use[insn->dst] == NEVER_USED) {
+        symbol_del(emitter->symbols[insn->dst]);
+    }
+}
+
+static void emit_binary(x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, insn_operand_t dst) {
+    const isel_cover_t *cover = &emitter->covers[position];
+    switch(insn->operr) {
+        case OP_ADD2:
+        case OP_SUB2:
+        case OP_MUL2:
+        case OP_SHL2:
+        case OP_SHR2:
+        case OP_SHRU2:
+            cover->pattern->emit(emitter, cover, dst);
+            break;
+        case OP_EQUL:
+        case OP_NEQL:
+        case OP_LESS:
+        case OP_GREA:
+            emit_compare(emitter, insn, dst);
+            break;
+        case OP_DIV2:
+        case OP_MOD2:
+            emit_divide(emitter, insn, dst);
+            break;
+        case OP_MULH2:
+            emit_multiply_high(emitter, insn, dst);
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+static void select_insns(x86_emitter_t *emitter) {
+    const ir_program_t *program = emitter->program;
+    for(size_t position = 0; position < program->len; ++position) {
+        const ir_insn_t *insn = &program->insns[position];
+        isel_cover_t *best = &emitter->covers[position];
+        *best = (isel_cover_t) { .pattern = NULL, .cost = ISEL_NO_MATCH, .operr = insn->operr, .a = insn->a,
+                                 .b = insn->b, .disp = 0, .index_shift = 0, .fused = IR_NO_VALUE, .skip = false };
+        if(insn->opcode != IR_BINARY || !op_has_patterns(insn->operr)) {
+            continue;
+        }
+
+        for(size_t p_idx = 0; p_idx < ISEL_PATTERNS_LEN; ++p_idx) {
+            isel_cover_t cover = { .operr = insn->operr, .a = insn->a, .b = insn->b, .disp = 0, .index_shift = 0,
+                                   .fused = IR_NO_VALUE, .skip = false };
+            int cost = isel_patterns[p_idx].match(emitter, position, insn, &cover);
+            if(cost < best->cost) {
+                *best = cover;
+                best->pattern = &isel_patterns[p_idx];
+                best->cost = cost;
+            }
+        }
+        // The two-address form covers everything.
+        assert(best->pattern != NULL);
+
+        if(best->fused != IR_NO_VALUE) {
+            // The swallowed instruction's operands are now read here instead, and its own value is never needed.
+            emitter->covers[emitter->def_position[best->fused]].skip = true;
+            emitter->last_use[best->fused] = NEVER_USED;
+            const ir_operand_t *reads[] = { &best->a, &best->b };
+            for(size_t idx = 0; idx < 2; ++idx) {
+                if(reads[idx]->is_value && emitter->last_use[reads[idx]->u.value] < position) {
+                    emitter->last_use[reads[idx]->u.value] = position;
+                }
+            }
+        }
+    }
+}
+
+// movl a, dst; op b, dst
+static int match_two_address(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    return copy_cost(emitter, position, cover->a, cover->b) + alu_cost(cover->b);
+}
+
+// movl b, dst; addl/imull a, dst
+static int match_two_address_swapped(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    if(insn->operr != OP_ADD2 && insn->operr != OP_MUL2) {
+        return ISEL_NO_MATCH;
+    }
+    cover->a = insn->b;
+    cover->b = insn->a;
+    return copy_cost(emitter, position, cover->a, cover->b) + alu_cost(cover->b);
+}
+
+// movl a, dst; incl/decl dst
+static int match_inc_dec(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    int32_t addend;
+    if(!split_addend(insn, &cover->a, &addend) || (addend != 1 && addend != -1)) {
+        return ISEL_NO_MATCH;
+    }
+    cover->b = ir_imm(addend);
+    cover->disp = addend;
+    return copy_cost(emitter, position, cover->a, cover->b) + UNARY_COST;
+}
+
+// 0 - b: movl b, dst; negl dst
+static int match_neg(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    if(insn->operr != OP_SUB2 || insn->a.is_value || insn->a.u.imm != 0 || !insn->b.is_value) {
+        return ISEL_NO_MATCH;
+    }
+    cover->a = insn->b;
+    cover->b = insn->a;
+    return copy_cost(emitter, position, cover->a, cover->b) + UNARY_COST;
+}
+
+// leal (a,b), dst or leal disp(a), dst: three operands, so nothing needs copying.
+static int match_lea(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    if(insn->operr == OP_ADD2 && insn->a.is_value && insn->b.is_value) {
+        return lea_cost(true, 0);
+    }
+    if(!split_addend(insn, &cover->a, &cover->disp)) {
+        return ISEL_NO_MATCH;
+    }
+    cover->b = ir_imm(0);
+    return lea_cost(false, cover->disp);
+}
+
+// leal disp(x,y), dst for (x + y) + disp and (x + disp) + y, where the inner addition isn't needed anywhere else
+static int match_lea_fused(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    ir_operand_t value;
+    int32_t addend;
+    if(split_addend(insn, &value, &addend)) {
+        const ir_insn_t *inner = fusable(emitter, value);
+        if(inner == NULL || inner->operr != OP_ADD2 || !inner->a.is_value || !inner->b.is_value) {
+            return ISEL_NO_MATCH;
+        }
+        cover->a = inner->a;
+        cover->b = inner->b;
+        cover->disp = addend;
+        cover->fused = value.u.value;
+        return lea_cost(true, addend) - emitter->covers[emitter->def_position[value.u.value]].cost;
+    }
+
+    if(insn->operr != OP_ADD2 || !insn->a.is_value || !insn->b.is_value) {
+        return ISEL_NO_MATCH;
+    }
+    const ir_operand_t sides[] = { insn->a, insn->b };
+    for(size_t idx = 0; idx < 2; ++idx) {
+        const ir_insn_t *inner = fusable(emitter, sides[idx]);
+        if(inner != NULL && split_addend(inner, &value, &addend)) {
+            cover->a = value;
+            cover->b = sides[1 - idx];
+            cover->disp = addend;
+            cover->fused = sides[idx].u.value;
+            return lea_cost(true, addend) - emitter->covers[emitter->def_position[sides[idx].u.value]].cost;
+        }
+    }
+    return ISEL_NO_MATCH;
+}
+
+// leal (x,y,2^k), dst for x + (y << k) with k up to 3, where the shift isn't needed anywhere else. Multiplying by 3, 5 and
+// 9 comes out of strength reduction like this.
+static int match_lea_scaled(const x86_emitter_t *emitter, size_t position, const ir_insn_t *insn, isel_cover_t *cover) {
+    if(insn->operr != OP_ADD2 || !insn->a.is_value || !insn->b.is_value) {
+        return ISEL_NO_MATCH;
+    }
+    const ir_operand_t sides[] = { insn->a, insn->b };
+    for(size_t idx = 0; idx < 2; ++idx) {
+        const ir_insn_t *inner = fusable(emitter, sides[idx]);
+        if(inner != NULL && inner->operr == OP_SHL2 && inner->a.is_value && !inner->b.is_value &&
+           (inner->b.u.imm & 31) >= 1 && (inner->b.u.imm & 31) <= 3) {
+            cover->a = sides[1 - idx];
+            cover->b = inner->a;
+            cover->index_shift = (uint8_t) (inner->b.u.imm & 31);
+            cover->fused = sides[idx].u.value;
+            return lea_cost(true, 0) - emitter->covers[emitter->def_position[sides[idx].u.value]].cost;
+        }
+    }
+    return ISEL_NO_MATCH;
+}
+
+// The instruction defining the operand, if this is its only use and it was covered on its own
+// N.B. Returns NULL otherwise
+static const ir_insn_t *fusable(const x86_emitter_t *emitter, ir_operand_t ir_operand) {
+    if(!ir_operand.is_value || emitter->num_uses[ir_operand.u.value] != 1 ||
+       emitter->def_position[ir_operand.u.value] == NEVER_USED) {
+        return NULL;
+    }
+    size_t def_position = emitter->def_position[ir_operand.u.value];
+    const isel_cover_t *cover = &emitter->covers[def_position];
+    if(cover->pattern == NULL || cover->fused != IR_NO_VALUE) {
+        return NULL;
+    }
+    return &emitter->program->insns[def_position];
+}
+
+// value + addend, for an addition or subtraction of a literal
+static bool split_addend(const ir_insn_t *insn, ir_operand_t *value, int32_t *addend) {
+    if(insn->operr != OP_ADD2 && insn->operr != OP_SUB2) {
+        return false;
+    }
+    if(insn->a.is_value && !insn->b.is_value) {
+        *value = insn->a;
+        // N.B. Wraps around, just like subl would
+        *addend = (insn->operr == OP_SUB2) ? (int32_t) (0u - (uint32_t) insn->b.u.imm) : insn->b.u.imm;
+        return true;
+    }
+    if(insn->operr == OP_ADD2 && !insn->a.is_value && insn->b.is_value) {
+        *value = insn->b;
+        *addend = insn->a.u.imm;
+        return true;
+    }
+    return false;
+}
+
+// What it takes to copy an operand into the destination first
+static int copy_cost(const x86_emitter_t *emitter, size_t position, ir_operand_t copied, ir_operand_t other) {
+    if(!copied.is_value) {
+        return MOVL_IMM_COST;
+    }
+    bool other_is_copied = other.is_value && other.u.value == copied.u.value;
+    if(emitter->last_use[copied.u.value] == position && !other_is_copied) {
+        return 0;
+    }
+    return MOVL_REG_COST;
+}
+
+// addl/subl (or about the same for imull and shifts) with src
+static int alu_cost(ir_operand_t src) {
+    if(src.is_value) {
+        return 2;
+    }
+    return (src.u.imm >= INT8_MIN && src.u.imm <= INT8_MAX) ? 3 : 6;
+}
+
+// Opcode, ModRM, then a SIB byte for the index and a displacement if there is one
+static int lea_cost(bool has_index, int32_t disp) {
+    int cost = has_index ? 3 : 2;
+    if(disp != 0) {
+        cost += (disp >= INT8_MIN && disp <= INT8_MAX) ? 1 : 4;
+    }
+    return cost;
+}
+
+static void emit_two_address(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst) {
+    // Start from a copy of the left operand so the original survives.
+    emit(emitter, INSN_MOVL, operand(emitter, cover->a), dst);
+    insn_operand_t src = operand(emitter, cover->b);
+    if(op_is_shift(cover->operr) && cover->b.is_value) {
+        // A shift count that isn't a literal has to be in %cl.
+        emit(emitter, INSN_MOVL, src, insn_reg(X86_RCX));
+        src = insn_reg(X86_RCX);
+    }
+    else if(op_is_shift(cover->operr)) {
+        src = insn_imm(cover->b.u.imm & 31);
+    }
+    emit(emitter, op_to_opcode(cover->operr), src, dst);
+}
+
+static void emit_inc_dec(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst) {
+    emit(emitter, INSN_MOVL, operand(emitter, cover->a), dst);
+    emit(emitter, cover->disp == 1 ? INSN_INCL : INSN_DECL, insn_none(), dst);
+}
+
+static void emit_neg(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst) {
+    emit(emitter, INSN_MOVL, operand(emitter, cover->a), dst);
+    emit(emitter, INSN_NEGL, insn_none(), dst);
+}
+
+static void emit_lea(x86_emitter_t *emitter, const isel_cover_t *cover, insn_operand_t dst) {
+    insn_operand_t index = insn_none();
+    if(cover->b.is_value) {
+        index = operand(emitter, cover->b);
+    }
+    insn_append(&emitter->insns, (insn_t) { .opcode = INSN_LEAL, .src = operand(emitter, cover->a), .dst = dst,
+                                            .index = index, .index_shift = cover->index_shift,
+                                            .disp = cover->disp });
+}
+
+static void emit_compare(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst) {
+    insn_cond_t cond = op_to_cond(insn->operr);
+    if(insn->a.is_value) {
+        emit(emitter, INSN_CMPL, operand(emitter, insn->b), operand(emitter, insn->a));
+    }
+    else if(insn->b.is_value) {
+        // cmpl can't compare against an immediate on the left, so flip the comparison around.
+        emit(emitter, INSN_CMPL, operand(emitter, insn->a), operand(emitter, insn->b));
+        cond = cond_swap(cond);
+    }
+    else {
+        // Only unoptimized programs compare two literals; put the left one in the result first.
+        emit(emitter, INSN_MOVL, operand(emitter, insn->a), dst);
+        emit(emitter, INSN_CMPL, operand(emitter, insn->b), dst);
+    }
+
+    // Branchless: materialize the flag as a byte and zero-extend it.
+    emit_setcc(emitter, cond, dst);
+    emit(emitter, INSN_MOVZBL, dst, dst);
+}
+
+// movl a, %eax; cltd; idivl b; then the quotient from %eax or the remainder from %edx. idivl can't take an immediate,
+// so a literal divisor (one strength reduction left alone) goes in a register of its own first; before %eax is
+// loaded, so that the allocator keeps it out of %eax and %edx.
+static void emit_divide(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst) {
+    symbol_table_index_t divisor_symbol = 0;
+    insn_operand_t divisor = operand(emitter, insn->b);
+    if(!insn->b.is_value) {
+        divisor_symbol = symbol_add();
+        divisor = symbol_operand(divisor_symbol);
+        emit(emitter, INSN_MOVL, operand(emitter, insn->b), divisor);
+    }
+    emit(emitter, INSN_MOVL, operand(emitter, insn->a), insn_reg(X86_RAX));
+    emit(emitter, INSN_CLTD, insn_none(), insn_none());
+    emit(emitter, INSN_IDIVL, divisor, insn_none());
+    emit(emitter, INSN_MOVL, insn_reg(insn->operr == OP_DIV2 ? X86_RAX : X86_RDX), dst);
+    if(!insn->b.is_value) {
+        symbol_del(divisor_symbol);
+    }
+}
+
+// movl $magic, %eax; imull x; movl %edx, dst. N.B. Strength reduction always puts the literal on the right.
+static void emit_multiply_high(x86_emitter_t *emitter, const ir_insn_t *insn, insn_operand_t dst) {
+    assert(insn->a.is_value && !insn->b.is_value);
+    emit(emitter, INSN_MOVL, operand(emitter, insn->b), insn_reg(X86_RAX));
+    emit(emitter, INSN_IMULL_WIDE, operand(emitter, insn->a), insn_none());
+    emit(emitter, INSN_MOVL, insn_reg(X86_RDX), dst);
+}
+
+static insn_operand_t operand(const x86_emitter_t *emitter, ir_operand_t ir_operand) {
+    if(!ir_operand.is_value) {
+        return insn_imm(ir_operand.u.imm);
+    }
+    return symbol_operand(emitter->symbols[ir_operand.u.value]);
+}
+
+// Frees the value's symbol once the instruction at `position` was the last one to need it.
+static void release_operand(const x86_emitter_t *emitter, ir_operand_t ir_operand, size_t position) {
+    if(ir_operand.is_value && emitter->last_use[ir_operand.u.value] == position) {
+        symbol_del(emitter->symbols[ir_operand.u.value]);
+    }
+}
+
+static void emit(x86_emitter_t *emitter, insn_opcode_t opcode, insn_operand_t src, insn_operand_t dst) {
+    insn_append(&emitter->insns, (insn_t) { .opcode = opcode, .src = src, .dst = dst });
+}
+
+static void emit_setcc(x86_emitter_t *emitter, insn_cond_t cond, insn_operand_t dst) {
+    insn_append(&emitter->insns, (insn_t) { .opcode = INSN_SETCC, .cond = cond, .src = insn_none(), .dst = dst });
+}
+
+static insn_opcode_t op_to_opcode(parse_node_operator_t operr) {
+    switch(operr) {
+        case OP_ADD2:
+            return INSN_ADDL;
+        case OP_SUB2:
+            return INSN_SUBL;
+        case OP_MUL2:
+            return INSN_IMULL;
+        case OP_SHL2:
+            return INSN_SALL;
+        case OP_SHR2:
+            return INSN_SARL;
+        case OP_SHRU2:
+            return INSN_SHRL;
+        default:
+            assert(false);
+            return INSN_MOVL;
+    }
+}
+
+// Whether the operation goes through the instruction selection patterns (everything two-address can do)
+static bool op_has_patterns(parse_node_operator_t operr) {
+    return operr == OP_ADD2 || operr == OP_SUB2 || operr == OP_MUL2 || op_is_shift(operr);
+}
+
+static bool op_is_shift(parse_node_operator_t operr) {
+    return operr == OP_SHL2 || operr == OP_SHR2 || operr == OP_SHRU2;
+}
+
+static insn_cond_t op_to_cond(parse_node_operator_t operr) {
+    switch(operr) {
+        case OP_EQUL:
+            return COND_E;
+        case OP_NEQL:
+            return COND_NE;
+        case OP_GREA:
+            return COND_G;
+        case OP_LESS:
+            return COND_L;
+        default:
+            assert(false);
+            return COND_E;
+    }
+}
+
+// The condition that holds for (b, a) whenever cond holds for (a, b)
+static insn_cond_t cond_swap(insn_cond_t cond) {
+    switch(cond) {
+        case COND_G:
+            return COND_L;
+        case COND_L:
+            return COND_G;
+        default:
+            return cond;
+    }
+}
+
+// Whether running the program could raise SIGFPE (only idivl traps)
+static bool program_may_trap(const insn_buffer_t *program) {
+    for(size_t idx = 0; idx < program->len; ++idx) {
+        if(program->insns[idx].opcode == INSN_IDIVL) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ir.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    // AT&T assembly of the program's body, as test/compile_helper expects it
+    X86_OUTPUT_ASM = 0,
+    // An ELF relocatable object defining main (see elf_writer.h)
+    X86_OUTPUT_OBJECT,
+    // A static ELF executable
+    X86_OUTPUT_EXECUTABLE,
+    // Run right away, printing the result (see jit.h)
+    X86_OUTPUT_JIT,
+} x86_output_format_t;
+
+// Where IR_LOAD and IR_STORE find variable slots: just above the return address, where the JIT keeps them.
+#define X86_VARIABLE_SLOT_OFFSET(slot) ((int32_t) (16 + 4 * (slot)))
+
+typedef struct {
+    x86_output_format_t format;
+    // How many instructions the peephole optimizer looks at at once (0 turns it off)
+    size_t peephole_window;
+    // Report what the peephole rules did on stderr
+    bool report;
+    // Someone is waiting for each JIT result as soon as it's ready
+    bool interactive;
+} x86_emit_options_t;
+
+// Selects x86 instructions for the program, allocates their registers, cleans up with the peephole optimizer and
+// writes the result in the requested format.
+void x86_emit_program(const ir_program_t *program, const x86_emit_options_t *options);
@@ -0,0 +1,382 @@
+#include "x86_encode.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INIT_CODE_BUFFER_LEN ((size_t) 4096)
+#define CODE_BUFFER_GROWTH_FACTOR ((size_t) 2)
+
+#define REX ((uint8_t) 0x40)
+#define REX_W ((uint8_t) 0x08)
+#define REX_R ((uint8_t) 0x04)
+#define REX_X ((uint8_t) 0x02)
+#define REX_B ((uint8_t) 0x01)
+
+#define MODRM_DISP8 ((uint8_t) 0x40)
+#define MODRM_DISP32 ((uint8_t) 0x80)
+#define MODRM_REG ((uint8_t) 0xC0)
+// The r/m field that says a SIB byte follows, and the SIB index field that says there is no index
+#define MODRM_SIB ((uint8_t) 0x04)
+#define SIB_NO_INDEX ((uint8_t) 0x20)
+
+// The /digit of the arithmetic group (0x01 add r/m,r ... 0x83 op r/m,imm8)
+typedef enum {
+    ALU_ADD = 0,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7,
+} alu_op_t;
+
+// The /digit of the shift group (0xC1 shift r/m,imm8, 0xD1 by one, 0xD3 by %cl)
+typedef enum {
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7,
+} shift_op_t;
+
+// An instruction's bytes are collected here first, since the REX prefix depends on all of its operands.
+typedef struct {
+    uint8_t bytes[16];
+    size_t len;
+} encoding_t;
+
+static void encode_alu(encoding_t *enc, alu_op_t op, const insn_t *insn);
+static void encode_movl(encoding_t *enc, const insn_t *insn);
+static void encode_leal(encoding_t *enc, const insn_t *insn);
+static void encode_imull(encoding_t *enc, const insn_t *insn);
+static void encode_shift(encoding_t *enc, shift_op_t op, const insn_t *insn);
+static void encode_modrm(encoding_t *enc, uint8_t rex, bool byte_regs, const uint8_t *opcode, size_t opcode_len,
+                         unsigned reg, const insn_operand_t *rm);
+static void encode_imm(encoding_t *enc, int32_t imm, bool short_form);
+static void encode_byte(encoding_t *enc, uint8_t byte);
+static bool fits_int8(int32_t value);
+static uint8_t cond_code(insn_cond_t cond);
+
+void code_buffer_append(code_buffer_t *code, const uint8_t *bytes, size_t len) {
+    if(code->len + len > code->cap) {
+        size_t new_cap = code->cap ? code->cap : INIT_CODE_BUFFER_LEN;
+        while(new_cap < code->len + len) {
+            new_cap *= CODE_BUFFER_GROWTH_FACTOR;
+        }
+        uint8_t *new_bytes = realloc(code->bytes, new_cap);
+        // TODO: Compiler error if out of memory
+        assert(new_bytes != NULL);
+        code->bytes = new_bytes;
+        code->cap = new_cap;
+    }
+    memcpy(code->bytes + code->len, bytes, len);
+    code->len += len;
+}
+
+void code_buffer_free(code_buffer_t *code) {
+    free(code->bytes);
+    *code = (code_buffer_t) CODE_BUFFER_INIT;
+}
+
+void x86_encode(code_buffer_t *code, const insn_t *insn, size_t call_target) {
+    encoding_t enc = { .len = 0 };
+
+    switch(insn->opcode) {
+        case INSN_NOP:
+            return;
+        case INSN_MOVL:
+            encode_movl(&enc, insn);
+            break;
+        case INSN_ADDL:
+            encode_alu(&enc, ALU_ADD, insn);
+            break;
+        case INSN_SUBL:
+            encode_alu(&enc, ALU_SUB, insn);
+            break;
+        case INSN_XORL:
+            encode_alu(&enc, ALU_XOR, insn);
+            break;
+        case INSN_CMPL:
+            encode_alu(&enc, ALU_CMP, insn);
+            break;
+        case INSN_LEAL:
+            encode_leal(&enc, insn);
+            break;
+        case INSN_INCL:
+        case INSN_DECL: {
+            const uint8_t opcode[] = { 0xFF };
+            encode_modrm(&enc, 0, false, opcode, sizeof opcode, insn->opcode == INSN_INCL ? 0 : 1, &insn->dst);
+            break;
+        }
+        case INSN_NEGL: {
+            const uint8_t opcode[] = { 0xF7 };
+            encode_modrm(&enc, 0, false, opcode, sizeof opcode, 3, &insn->dst);
+            break;
+        }
+        case INSN_IMULL:
+            encode_imull(&enc, insn);
+            break;
+        case INSN_SALL:
+            encode_shift(&enc, SHIFT_SHL, insn);
+            break;
+        case INSN_SARL:
+            encode_shift(&enc, SHIFT_SAR, insn);
+            break;
+        case INSN_SHRL:
+            encode_shift(&enc, SHIFT_SHR, insn);
+            break;
+        case INSN_CLTD:
+            encode_byte(&enc, 0x99);
+            break;
+        case INSN_IMULL_WIDE:
+        case INSN_IDIVL: {
+            const uint8_t opcode[] = { 0xF7 };
+            encode_modrm(&enc, 0, false, opcode, sizeof opcode, insn->opcode == INSN_IMULL_WIDE ? 5 : 7, &insn->src);
+            break;
+        }
+        case INSN_SETCC: {
+            const uint8_t opcode[] = { 0x0F, (uint8_t) (0x90 | cond_code(insn->cond)) };
+            encode_modrm(&enc, 0, true, opcode, sizeof opcode, 0, &insn->dst);
+            break;
+        }
+        case INSN_MOVZBL: {
+            assert(insn->dst.kind == OPND_REG);
+            const uint8_t opcode[] = { 0x0F, 0xB6 };
+            encode_modrm(&enc, 0, true, opcode, sizeof opcode, insn->dst.u.reg, &insn->src);
+            break;
+        }
+        case INSN_CALL: {
+            // rel32 is relative to the end of the instruction
+            int32_t rel = (int32_t) ((int64_t) call_target - (int64_t) (code->len + 5));
+            encode_byte(&enc, 0xE8);
+            encode_imm(&enc, rel, false);
+            break;
+        }
+        case INSN_PUSHQ:
+        case INSN_POPQ: {
+            // N.B. Both keep their register in src
+            const insn_operand_t *operand = &insn->src;
+            assert(operand->kind == OPND_REG);
+            if(operand->u.reg & 8) {
+                encode_byte(&enc, REX | REX_B);
+            }
+            encode_byte(&enc, (uint8_t) ((insn->opcode == INSN_PUSHQ ? 0x50 : 0x58) | (operand->u.reg & 7)));
+            break;
+        }
+        case INSN_MOVQ: {
+            assert(insn->src.kind == OPND_REG);
+            const uint8_t opcode[] = { 0x89 };
+            encode_modrm(&enc, REX_W, false, opcode, sizeof opcode, insn->src.u.reg, &insn->dst);
+            break;
+        }
+        case INSN_SUBQ: {
+            assert(insn->src.kind == OPND_IMM);
+            bool short_form = fits_int8(insn->src.u.imm);
+            const uint8_t opcode[] = { short_form ? 0x83 : 0x81 };
+            encode_modrm(&enc, REX_W, false, opcode, sizeof opcode, ALU_SUB, &insn->dst);
+            encode_imm(&enc, insn->src.u.imm, short_form);
+            break;
+        }
+        case INSN_LEAQ: {
+            assert(insn->src.kind == OPND_MEM && insn->dst.kind == OPND_REG);
+            const uint8_t opcode[] = { 0x8D };
+            encode_modrm(&enc, REX_W, false, opcode, sizeof opcode, insn->dst.u.reg, &insn->src);
+            break;
+        }
+        case INSN_LEAVE:
+            encode_byte(&enc, 0xC9);
+            break;
+        default:
+            assert(false);
+            return;
+    }
+
+    code_buffer_append(code, enc.bytes, enc.len);
+}
+
+// add/sub/xor/cmp, 32-bit
+static void encode_alu(encoding_t *enc, alu_op_t op, const insn_t *insn) {
+    assert(insn->dst.kind == OPND_REG || insn->dst.kind == OPND_MEM);
+
+    if(insn->src.kind == OPND_IMM) {
+        bool short_form = fits_int8(insn->src.u.imm);
+        const uint8_t opcode[] = { short_form ? 0x83 : 0x81 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, op, &insn->dst);
+        encode_imm(enc, insn->src.u.imm, short_form);
+    }
+    else if(insn->src.kind == OPND_REG) {
+        // op r/m32, r32
+        const uint8_t opcode[] = { (uint8_t) (op << 3 | 0x01) };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->src.u.reg, &insn->dst);
+    }
+    else {
+        // op r32, r/m32
+        assert(insn->src.kind == OPND_MEM && insn->dst.kind == OPND_REG);
+        const uint8_t opcode[] = { (uint8_t) (op << 3 | 0x03) };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->dst.u.reg, &insn->src);
+    }
+}
+
+static void encode_movl(encoding_t *enc, const insn_t *insn) {
+    if(insn->src.kind == OPND_IMM && insn->dst.kind == OPND_REG) {
+        // mov r32, imm32 has the register in the opcode
+        if(insn->dst.u.reg & 8) {
+            encode_byte(enc, REX | REX_B);
+        }
+        encode_byte(enc, (uint8_t) (0xB8 | (insn->dst.u.reg & 7)));
+        encode_imm(enc, insn->src.u.imm, false);
+    }
+    else if(insn->src.kind == OPND_IMM) {
+        const uint8_t opcode[] = { 0xC7 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, 0, &insn->dst);
+        encode_imm(enc, insn->src.u.imm, false);
+    }
+    else if(insn->src.kind == OPND_REG) {
+        const uint8_t opcode[] = { 0x89 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->src.u.reg, &insn->dst);
+    }
+    else {
+        assert(insn->src.kind == OPND_MEM && insn->dst.kind == OPND_REG);
+        const uint8_t opcode[] = { 0x8B };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->dst.u.reg, &insn->src);
+    }
+}
+
+// lea r32, [base + index * scale + disp]. The allocator only leaves registers in the address. %rsp and %r12 as a base need a
+// SIB byte, and %rbp and %r13 need a displacement even when it's zero (mod 00 would mean something else for them).
+static void encode_leal(encoding_t *enc, const insn_t *insn) {
+    assert(insn->src.kind == OPND_REG && insn->dst.kind == OPND_REG);
+    assert(insn->index.kind == OPND_NONE || (insn->index.kind == OPND_REG && insn->index.u.reg != X86_RSP));
+    x86_register_t base = insn->src.u.reg;
+    bool has_index = insn->index.kind == OPND_REG;
+
+    uint8_t rex = 0;
+    if(insn->dst.u.reg & 8) {
+        rex |= REX_R;
+    }
+    if(has_index && (insn->index.u.reg & 8)) {
+        rex |= REX_X;
+    }
+    if(base & 8) {
+        rex |= REX_B;
+    }
+    if(rex != 0) {
+        encode_byte(enc, REX | rex);
+    }
+    encode_byte(enc, 0x8D);
+
+    uint8_t mod = 0;
+    if(insn->disp != 0 || (base & 7) == X86_RBP) {
+        mod = fits_int8(insn->disp) ? MODRM_DISP8 : MODRM_DISP32;
+    }
+    uint8_t reg_bits = (uint8_t) ((insn->dst.u.reg & 7) << 3);
+    if(has_index || (base & 7) == X86_RSP) {
+        encode_byte(enc, mod | reg_bits | MODRM_SIB);
+        uint8_t index_bits = has_index ? (uint8_t) ((insn->index.u.reg & 7) << 3) : SIB_NO_INDEX;
+        encode_byte(enc, (uint8_t) (insn->index_shift << 6) | index_bits | (base & 7));
+    }
+    else {
+        encode_byte(enc, mod | reg_bits | (base & 7));
+    }
+    if(mod != 0) {
+        encode_imm(enc, insn->disp, mod == MODRM_DISP8);
+    }
+}
+
+// imul r32, r/m32, or imul r32, r32, imm with the destination as the source too
+static void encode_imull(encoding_t *enc, const insn_t *insn) {
+    assert(insn->dst.kind == OPND_REG);
+    if(insn->src.kind == OPND_IMM) {
+        bool short_form = fits_int8(insn->src.u.imm);
+        const uint8_t opcode[] = { short_form ? 0x6B : 0x69 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->dst.u.reg, &insn->dst);
+        encode_imm(enc, insn->src.u.imm, short_form);
+    }
+    else {
+        const uint8_t opcode[] = { 0x0F, 0xAF };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, insn->dst.u.reg, &insn->src);
+    }
+}
+
+// shl/shr/sar r/m32, by an immediate or by %cl
+static void encode_shift(encoding_t *enc, shift_op_t op, const insn_t *insn) {
+    if(insn->src.kind == OPND_IMM && insn->src.u.imm == 1) {
+        const uint8_t opcode[] = { 0xD1 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, op, &insn->dst);
+    }
+    else if(insn->src.kind == OPND_IMM) {
+        const uint8_t opcode[] = { 0xC1 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, op, &insn->dst);
+        encode_imm(enc, insn->src.u.imm, true);
+    }
+    else {
+        assert(insn->src.kind == OPND_REG && insn->src.u.reg == X86_RCX);
+        const uint8_t opcode[] = { 0xD3 };
+        encode_modrm(enc, 0, false, opcode, sizeof opcode, op, &insn->dst);
+    }
+}
+
+// Prefix, opcode and ModRM (plus displacement) for an instruction whose r/m operand is `rm` and whose reg field is
+// `reg` (a register, or the opcode extension). With `byte_regs`, the r/m register is a byte register: %spl, %bpl, %sil
+// and %dil only exist with a REX prefix (without one, those encodings mean %ah, %ch, %dh and %bh).
+static void encode_modrm(encoding_t *enc, uint8_t rex, bool byte_regs, const uint8_t *opcode, size_t opcode_len,
+                         unsigned reg, const insn_operand_t *rm) {
+    if(reg & 8) {
+        rex |= REX_R;
+    }
+    if(rm->kind == OPND_REG && (rm->u.reg & 8)) {
+        rex |= REX_B;
+    }
+    bool needs_rex = rex != 0 || (byte_regs && rm->kind == OPND_REG && rm->u.reg >= X86_RSP && rm->u.reg <= X86_RDI);
+    if(needs_rex) {
+        encode_byte(enc, REX | rex);
+    }
+    for(size_t idx = 0; idx < opcode_len; ++idx) {
+        encode_byte(enc, opcode[idx]);
+    }
+
+    uint8_t reg_bits = (uint8_t) ((reg & 7) << 3);
+    if(rm->kind == OPND_REG) {
+        encode_byte(enc, MODRM_REG | reg_bits | (rm->u.reg & 7));
+    }
+    else {
+        // N.B. Always with a displacement: mod 00 with %rbp as the base would mean %rip-relative.
+        assert(rm->kind == OPND_MEM);
+        bool short_disp = fits_int8(rm->u.mem_offset);
+        encode_byte(enc, (short_disp ? MODRM_DISP8 : MODRM_DISP32) | reg_bits | X86_RBP);
+        encode_imm(enc, rm->u.mem_offset, short_disp);
+    }
+}
+
+// Little-endian, either a single byte or all four
+static void encode_imm(encoding_t *enc, int32_t imm, bool short_form) {
+    uint32_t bits = (uint32_t) imm;
+    encode_byte(enc, (uint8_t) bits);
+    if(!short_form) {
+        encode_byte(enc, (uint8_t) (bits >> 8));
+        encode_byte(enc, (uint8_t) (bits >> 16));
+        encode_byte(enc, (uint8_t) (bits >> 24));
+    }
+}
+
+static void encode_byte(encoding_t *enc, uint8_t byte) {
+    assert(enc->len < sizeof enc->bytes);
+    enc->bytes[enc->len++] = byte;
+}
+
+static bool fits_int8(int32_t value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static uint8_t cond_code(insn_cond_t cond) {
+    switch(cond) {
+        case COND_E:
+            return 0x4;
+        case COND_NE:
+            return 0x5;
+        case COND_G:
+            return 0xF;
+        case COND_L:
+            return 0xC;
+        default:
+            assert(false);
+            return 0;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "insn_buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Machine code under construction
+typedef struct {
+    uint8_t *bytes;
+    size_t len;
+    size_t cap;
+} code_buffer_t;
+
+#define CODE_BUFFER_INIT { .bytes = NULL, .len = 0, .cap = 0 }
+
+void code_buffer_append(code_buffer_t *code, const uint8_t *bytes, size_t len);
+void code_buffer_free(code_buffer_t *code);
+
+// Appends the x86-64 encoding of the instruction to `code`. An INSN_CALL goes to `call_target`, an offset into `code`.
+// N.B. All virtual registers must have been replaced by real locations.
+void x86_encode(code_buffer_t *code, const insn_t *insn, size_t call_target);